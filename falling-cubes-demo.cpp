@@ -24,26 +24,113 @@
 
 #include <iostream>  
 #include <vector>    
+#include <array>
+#include <type_traits>
 #include <cmath>     
 #include <random>    
 #include <chrono>    
 #include <iomanip>   
 #include <cstdio>    
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <unordered_map>
+#include <numeric>
+#include <atomic>
+#include <immintrin.h>
 #include <fcntl.h>   
 #include <io.h>      
 
 const int WINDOW_WIDTH = 800;
 const int WINDOW_HEIGHT = 600;
-const float GRAVITY = 9.81f;        
-const float GROUND_Y = -2.0f;       
-const float CUBE_SIZE = 0.5f;       
+constexpr float GRAVITY = 9.81f;      
+constexpr float GROUND_Y = -2.0f;     
+constexpr float CUBE_SIZE = 0.5f;       
+constexpr float MIN_CUBE_SIZE = CUBE_SIZE;
+constexpr float MAX_CUBE_SIZE = CUBE_SIZE;
 const int NUM_CUBES = 100;          
-const float BOUNCE_FACTOR = 1.0f;   
-const float FRICTION_FACTOR = 0.9f; 
-const float REST_THRESHOLD = 0.05f; 
-const float RESET_INTERVAL_SECONDS = 13.0f; 
+const int FIXED_WORLD_MAX_CUBES = 256;
+constexpr float BOUNCE_FACTOR = 1.0f;   
+constexpr float FRICTION_FACTOR = 0.9f; 
+const float CUBE_DENSITY = 8.0f;
+constexpr float REST_THRESHOLD = 0.05f; 
+constexpr float RESET_INTERVAL_SECONDS = 13.0f; 
 const float AUTO_ROTATE_SPEED_Y = 100.0f; 
 const float CAMERA_HEIGHT_OFFSET = 8.0f; 
+const bool UNBOUNDED_WORLD = false;
+const float REGION_SIZE = 64.0f;
+const float REBASE_DISTANCE = 1024.0f;
+const int REGION_SORT_INTERVAL = 60;
+const bool PAGE_SLEEPING_REGIONS = false;
+const float PAGE_IN_DISTANCE = 128.0f;
+const float PAGE_OUT_DISTANCE = 192.0f;
+const unsigned long long PAGE_FILE_BYTES = 1ull << 30;
+const unsigned long long PAGE_SLAB_BYTES = 1ull << 16;
+const bool CONSOLIDATE_PILES = false;
+const float CONSOLIDATE_AFTER_SECONDS = 2.0f;
+const int CONSOLIDATE_INTERVAL = 30;
+const int MIN_COMPOUND_BODIES = 4;
+const float COMPOUND_CONTACT_MARGIN = 0.01f;
+const float COMPOUND_SPLIT_SPEED = 3.0f;
+const float COMPOUND_SPLIT_RADIUS = 1.0f;
+const bool MULTI_RATE_STEPPING = false;
+const int MAX_RATE_LEVEL = 3;
+const float MULTI_RATE_MAX_TRAVEL = 0.05f;
+const bool TIME_BUDGETED_STEP = false;
+const float STEP_BUDGET_MS = 4.0f;
+const int BUDGET_CHECK_INTERVAL = 8;
+const bool ADAPTIVE_BROADPHASE = false;
+const int ADAPT_PROBE_INTERVAL = 30;
+const int ADAPT_MAX_PROBE_INTERVAL = 1920;
+const int ADAPT_PROBE_STEPS = 4;
+const float ADAPT_HYSTERESIS = 0.1f;
+const int ADAPT_TILED_MAX_BODIES = 4096;
+const bool COLLISION_LAYERS = false;
+const float DEBRIS_FRACTION = 0.0f;
+const bool MIXED_SHAPES = false;
+const float SPHERE_FRACTION = 0.4f;
+const float CAPSULE_FRACTION = 0.2f;
+const bool MUTUAL_ATTRACTION = false;
+const float ATTRACTION_STRENGTH = 0.5f;
+const float ATTRACTION_SOFTENING = 0.25f;
+const float BARNES_HUT_THETA = 0.5f;
+const int OCTREE_LEAF_SIZE = 8;
+const int WORKER_THREADS = 0;
+const int MAX_WORKER_THREADS = 63;
+const bool LEAPFROG_INTEGRATOR = false;
+const bool RK4_INTEGRATOR = false;
+const bool GRANULAR_MODE = false;
+const int GRANULAR_PARTICLES = 20000;
+const float GRANULAR_RADIUS = 0.05f;
+const float GRANULAR_STIFFNESS = 20000.0f;
+const float GRANULAR_DAMPING = 100.0f;
+const float GRANULAR_TANGENTIAL_DAMPING = 20.0f;
+const int GRANULAR_SUBSTEPS = 8;
+const bool FLUID_MODE = false;
+const int FLUID_PARTICLES = 20000;
+const float FLUID_SPACING = 0.05f;
+const float FLUID_REST_DENSITY = 1000.0f;
+const float FLUID_SOUND_SPEED = 20.0f;
+const float FLUID_VISCOSITY = 10.0f;
+const int FLUID_SUBSTEPS = 8;
+const bool POSITION_BASED_SOLVER = false;
+const int PBD_SUBSTEPS = 4;
+const int PBD_ITERATIONS = 2;
+const int PBD_STABILIZATION_ITERATIONS = 2;
+const float PBD_RELAXATION = 1.5f;
+const bool FIXED_POINT_MODE = false;
+const int FIXED_TICK_RATE = 120;
+const uint64_t FIXED_POINT_SEED = 0x5eedu;
+const bool SETTLE_SCENES = false;
+const float SETTLE_BOUNCE_FACTOR = 0.5f;
+const float RESTITUTION_MIN_SPEED = 1.0f;
+const float STICK_SPEED = 0.2f;
+const float LINEAR_DAMPING = 0.2f;
+const float CONTACT_ANGULAR_DAMPING = 4.0f;
+const bool CONTACT_EVENTS = false;
+const int CONTACT_END_STEPS = 2;
+const bool PREPARE_NEXT_SCENE = false;
+const float SCENE_WARMUP_SECONDS = 0.0f;
 
 const bool DEBUG_MODE = false;
 
@@ -51,6 +138,7 @@ HDC   g_hDC = NULL;
 HGLRC g_hRC = NULL;
 HWND  g_hWnd = NULL;
 HINSTANCE g_hInstance;
+GLUquadric* quadric = NULL;
 
 float rotateX = 0.0f; 
 float rotateY = 0.0f; 
@@ -59,8 +147,8 @@ std::mt19937 rng(std::chrono::steady_clock::now().time_since_epoch().count());
 std::uniform_real_distribution<float> dist_xz(-4.0f, 4.0f); 
 std::uniform_real_distribution<float> dist_height(5.0f, 15.0f); 
 std::uniform_real_distribution<float> dist_bounce_angle(-0.5f, 0.5f); 
-std::uniform_real_distribution<float> dist_angular_vel(-180.0f, 180.0f); 
 std::uniform_real_distribution<float> dist_color(0.0f, 1.0f); 
+std::uniform_real_distribution<float> dist_log_size(std::log(MIN_CUBE_SIZE), std::log(MAX_CUBE_SIZE));
 
 std::chrono::high_resolution_clock::time_point lastFrameTime;
 
@@ -72,16 +160,33 @@ int frameCount = 0;
 
 float resetTimer = 0.0f;
 
+float simulationTime = 0.0f;
+
+// Simulation time from the last reset until every body was first at rest,
+// or -1 while something is still moving.
+float settleTime = -1.0f;
+
+// Where the float origin sits in the unbounded world; only x and z drift,
+// the ground keeps y anchored.
+double worldOriginX = 0.0;
+double worldOriginZ = 0.0;
+int stepsSinceRegionSort = 0;
+int stepsSinceConsolidation = 0;
+unsigned stepIndex = 0;
+// Counts every step since startup and is never reset, so caches keyed on it
+// cannot mistake a new scene for the old one.
+unsigned long long stepSerial = 0;
+
 typedef BOOL (WINAPI * PFNWGLSWAPINTERVALEXTPROC) (int interval);
 PFNWGLSWAPINTERVALEXTPROC wglSwapIntervalEXT = NULL;
 
 struct Vec3 {
     float x, y, z;
 
-    Vec3() : x(0.0f), y(0.0f), z(0.0f) {}
-    Vec3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+    constexpr Vec3() : x(0.0f), y(0.0f), z(0.0f) {}
+    constexpr Vec3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
 
-    Vec3 operator+(const Vec3& other) const { return Vec3(x + other.x, y + other.y, z + other.y); }
+    Vec3 operator+(const Vec3& other) const { return Vec3(x + other.x, y + other.y, z + other.z); }
 
     Vec3 operator-(const Vec3& other) const { return Vec3(x - other.x, y - other.y, z - other.z); }
 
@@ -91,7 +196,7 @@ struct Vec3 {
 
     Vec3 cross(const Vec3& other) const {
         return Vec3(y * other.z - z * other.y,
-                    z * other.x - x * other.y,
+                    z * other.x - x * other.z,
                     x * other.y - y * other.x);
     }
 
@@ -104,496 +209,5777 @@ struct Vec3 {
     }
 };
 
-struct Cube {
-    Vec3 position;
-    Vec3 velocity;
-    Vec3 angularVelocity; 
-    Vec3 rotation;        
-    float size;
-    bool resting;         
+struct Quat {
+    float w, x, y, z;
+
+    constexpr Quat() : w(1.0f), x(0.0f), y(0.0f), z(0.0f) {}
+    constexpr Quat(float _w, float _x, float _y, float _z) : w(_w), x(_x), y(_y), z(_z) {}
+
+    Quat operator*(const Quat& o) const {
+        return Quat(w * o.w - x * o.x - y * o.y - z * o.z,
+                    w * o.x + x * o.w + y * o.z - z * o.y,
+                    w * o.y - x * o.z + y * o.w + z * o.x,
+                    w * o.z + x * o.y - y * o.x + z * o.w);
+    }
+
+    // One Newton step towards unit length; enough for the drift left by a
+    // single product of unit quaternions.
+    Quat renormalized() const {
+        float k = 0.5f * (3.0f - (w * w + x * x + y * y + z * z));
+        return Quat(w * k, x * k, y * k, z * k);
+    }
+
+    // Rotation reached after spinning at world-space angular velocity
+    // `spin` (rad/s) for `time` seconds.
+    static Quat fromSpin(const Vec3& spin, float time) {
+        float rate = spin.length();
+        if (rate == 0.0f) return Quat();
+        float half = rate * time * 0.5f;
+        float k = std::sin(half) / rate;
+        return Quat(std::cos(half), spin.x * k, spin.y * k, spin.z * k);
+    }
 };
 
-std::vector<Cube> cubes; 
+// Uniform-density box: I = m/12 * (h^2 + d^2, w^2 + d^2, w^2 + h^2). For
+// cubes every diagonal entry is m * s^2 / 6, so one scalar per body suffices.
+inline float boxInverseInertia(float size, float mass) {
+    return 6.0f / (mass * size * size);
+}
 
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
-void EnableOpenGL(HWND hWnd, HDC* hDC, HGLRC* hRC);
-void DisableOpenGL(HWND hWnd, HDC hDC, HGLRC hRC);
-void initOpenGL();
-void display();
-void reshape(int width, int height);
-void resetCubes();
-void updatePhysics(float deltaTime);
-void drawCube(const Vec3& position, const Vec3& rotation, float size);
+const int PAIR_TILE = 16;
+const float PADDING_POSITION = 1.0e30f;
 
-int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
-    WNDCLASS wc;
-    MSG msg;
-    BOOL bQuit = FALSE;
+struct Matrix4 {
+    float m[16];
+};
 
-    g_hInstance = hInstance; 
+struct CubeColumnPointers {
+    float *px, *py, *pz;
+    float *vx, *vy, *vz;
+    float *wx, *wy, *wz;
+    float *qw, *qx, *qy, *qz;
+    float *rotationTime;
+    float *size;
+    unsigned *layer, *mask;
+};
 
-    if (DEBUG_MODE) {
-        AllocConsole();
-        HANDLE handle_out = GetStdHandle(STD_OUTPUT_HANDLE);
-        int hCrt = _open_osfhandle((intptr_t)handle_out, _O_TEXT);
-        FILE* hf_out = _fdopen(hCrt, "w");
-        setvbuf(hf_out, NULL, _IONBF, 1);
-        *stdout = *hf_out;
-        std::cout.clear();
+// Two bodies collide when each one's layer is in the other's mask. Walls and
+// the ground are not layered: every body hits them.
+const unsigned LAYER_GAMEPLAY = 1u << 0;
+const unsigned LAYER_DEBRIS = 1u << 1;
+const unsigned MASK_ALL = ~0u;
+
+enum WallFlag : unsigned char {
+    WALL_GROUND = 1,
+    WALL_MIN_X = 2,
+    WALL_MAX_X = 4,
+    WALL_MIN_Z = 8,
+    WALL_MAX_Z = 16,
+    // Set by the pair pass rather than the wall kernel.
+    CONTACT_BODY = 32,
+    // Names a consolidated pile in contact events; never set in wallFlags.
+    CONTACT_COMPOUND = 64
+};
+
+// Every shape fits the cube of its body's size, so the broadphase and the
+// walls see the same bounds for all of them. A capsule runs along its local
+// y axis, with radius and half-length both a quarter of the size.
+enum ShapeType : unsigned char {
+    SHAPE_BOX,
+    SHAPE_SPHERE,
+    SHAPE_CAPSULE,
+    NUM_SHAPES
+};
+
+// Particle state for the granular and fluid modes; all particles share one
+// radius and mass. Columns are padded by PARTICLE_PADDING readable slots so
+// the vector kernels can run whole lanes past the end of a range.
+const int PARTICLE_PADDING = 16;
+
+struct ParticleColumns {
+    const float *x, *y, *z;
+    const float *vx, *vy, *vz;
+};
+
+// Linear spring-dashpot between equal spheres, per unit mass.
+struct SpringContact {
+    float diameter;
+    float stiffness;
+    float damping;
+    float tangentialDamping;
+};
+
+// Fluid particles also carry pressure / density^2 and 1 / density, filled in
+// by the density pass before the force pass reads them.
+struct FluidColumns {
+    ParticleColumns p;
+    const float *pressure, *invDensity;
+};
+
+// Smoothing radius and the particle mass folded into the spiky-gradient and
+// viscosity-Laplacian kernel constants.
+struct SphKernel {
+    float radius;
+    float pressureScale;
+    float viscosityScale;
+};
+
+// Q16.16 state for the deterministic lockstep mode. Velocities are held in
+// units per tick, so integration is additions only and needs no dt multiply.
+typedef int32_t Fixed;
+const int FIXED_SHIFT = 16;
+const Fixed FIXED_ONE = 1 << FIXED_SHIFT;
+const Fixed FIXED_PADDING = 1 << 30;
+
+// Only ever applied to compile-time constants, so no runtime float rounding
+// reaches the state.
+constexpr Fixed toFixed(double x) { return (Fixed)(x * FIXED_ONE + (x < 0.0 ? -0.5 : 0.5)); }
+
+struct FixedColumnPointers {
+    Fixed *px, *py, *pz;
+    Fixed *vx, *vy, *vz;
+    const Fixed *half;
+};
+
+// Rays are cast in packets of RAY_PACKET, stored by lane. Directions are
+// stored inverted, and tmax shrinks to the nearest hit found so far.
+const int RAY_PACKET = 8;
+
+struct RayPacket {
+    float ox[RAY_PACKET], oy[RAY_PACKET], oz[RAY_PACKET];
+    float invX[RAY_PACKET], invY[RAY_PACKET], invZ[RAY_PACKET];
+    float tmax[RAY_PACKET];
+    int body[RAY_PACKET];
+};
+
+struct BoxTree;
+
+enum class CpuIsa { Scalar, SSE2, AVX2, AVX512 };
+
+// Hot kernels over the SoA columns, one table per instruction set. The table
+// in use is picked once at startup by selectKernels().
+struct SimdKernels {
+    CpuIsa isa;
+    const char* name;
+    void (*integrate)(const CubeColumnPointers& c, int count, float deltaTime);
+    void (*integrateVarying)(const CubeColumnPointers& c, int count, const float* deltaTimes);
+    void (*wallFlags)(const CubeColumnPointers& c, int count, float groundY, float bound, unsigned char* flags);
+    unsigned (*overlapTile)(const CubeColumnPointers& c, int i, int base);
+    void (*buildTransforms)(const CubeColumnPointers& c, int count, float time, Matrix4* transforms);
+    void (*attract)(const float* px, const float* py, const float* pz, const float* mass, int count, float x, float y, float z, float softening, float* acceleration);
+    void (*springContacts)(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration);
+    void (*sphDensity)(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density);
+    void (*sphForces)(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration);
+    void (*integrateFixed)(const FixedColumnPointers& c, int count, Fixed gravity);
+    void (*wallFlagsFixed)(const FixedColumnPointers& c, int count, Fixed groundY, Fixed bound, unsigned char* flags);
+    unsigned (*overlapTileFixed)(const FixedColumnPointers& c, int i, int base);
+    void (*castPacket)(const BoxTree& tree, RayPacket& packet);
+};
+
+void integrateScalar(const CubeColumnPointers& c, int first, int count, float deltaTime) {
+    for (int i = first; i < count; ++i) {
+        c.vy[i] -= GRAVITY * deltaTime;
+
+        c.px[i] += c.vx[i] * deltaTime;
+        c.py[i] += c.vy[i] * deltaTime;
+        c.pz[i] += c.vz[i] * deltaTime;
     }
+}
 
-    wc.style = CS_OWNDC;
-    wc.lpfnWndProc = WndProc;
-    wc.cbClsExtra = 0;
-    wc.cbWndExtra = 0;
-    wc.hInstance = hInstance;
-    wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
-    wc.hCursor = LoadCursor(NULL, IDC_ARROW);
-    wc.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
-    wc.lpszMenuName = NULL;
-    wc.lpszClassName = "OpenGLWinClass";
-    RegisterClass(&wc);
+// A zero step leaves a body exactly as it was.
+void integrateVaryingScalar(const CubeColumnPointers& c, int first, int count, const float* deltaTimes) {
+    for (int i = first; i < count; ++i) {
+        c.vy[i] -= GRAVITY * deltaTimes[i];
 
-    int screenWidth = GetSystemMetrics(SM_CXSCREEN);
-    int screenHeight = GetSystemMetrics(SM_CYSCREEN);
+        c.px[i] += c.vx[i] * deltaTimes[i];
+        c.py[i] += c.vy[i] * deltaTimes[i];
+        c.pz[i] += c.vz[i] * deltaTimes[i];
+    }
+}
 
-    g_hWnd = CreateWindowEx(
-        0,
-        "OpenGLWinClass",
-        "",
-        WS_POPUP | WS_VISIBLE, 
-        0, 
-        0, 
-        screenWidth, 
-        screenHeight, 
-        NULL,
-        NULL,
-        hInstance,
-        NULL);
+void wallFlagsScalar(const CubeColumnPointers& c, int first, int count, float groundY, float bound, unsigned char* flags) {
+    for (int i = first; i < count; ++i) {
+        float halfSize = c.size[i] / 2.0f;
+        unsigned char f = 0;
+        if (c.py[i] - halfSize < groundY) f |= WALL_GROUND;
+        if (c.px[i] - halfSize < -bound) f |= WALL_MIN_X;
+        else if (c.px[i] + halfSize > bound) f |= WALL_MAX_X;
+        if (c.pz[i] - halfSize < -bound) f |= WALL_MIN_Z;
+        else if (c.pz[i] + halfSize > bound) f |= WALL_MAX_Z;
+        flags[i] = f;
+    }
+}
 
-    if (!g_hWnd) {
-        MessageBox(NULL, "Window Creation Failed!", "Error", MB_OK | MB_ICONERROR);
-        return 0;
+unsigned overlapTileScalar(const CubeColumnPointers& c, int i, int base) {
+    float h1 = c.size[i] / 2.0f;
+    float c1_minX = c.px[i] - h1, c1_maxX = c.px[i] + h1;
+    float c1_minY = c.py[i] - h1, c1_maxY = c.py[i] + h1;
+    float c1_minZ = c.pz[i] - h1, c1_maxZ = c.pz[i] + h1;
+
+    unsigned mask = 0;
+    for (int k = 0; k < PAIR_TILE; ++k) {
+        int j = base + k;
+        float h2 = c.size[j] / 2.0f;
+        bool overlapX = (c1_maxX > c.px[j] - h2) & (c1_minX < c.px[j] + h2);
+        bool overlapY = (c1_maxY > c.py[j] - h2) & (c1_minY < c.py[j] + h2);
+        bool overlapZ = (c1_maxZ > c.pz[j] - h2) & (c1_minZ < c.pz[j] + h2);
+        mask |= (unsigned)(overlapX & overlapY & overlapZ) << k;
     }
+    return mask;
+}
 
-    EnableOpenGL(g_hWnd, &g_hDC, &g_hRC);
+inline bool layersCollide(const CubeColumnPointers& c, int i, int j) {
+    return (c.layer[i] & c.mask[j]) && (c.layer[j] & c.mask[i]);
+}
 
-    initOpenGL();
+// Lanes of the tile at base whose layers accept body i. Padding slots have
+// an empty layer, so they are never accepted.
+inline unsigned layerTile(const CubeColumnPointers& c, int i, int base) {
+    unsigned accepted = 0;
+    for (int k = 0; k < PAIR_TILE; ++k) {
+        accepted |= (unsigned)((c.layer[i] & c.mask[base + k]) && (c.layer[base + k] & c.mask[i])) << k;
+    }
+    return accepted;
+}
 
-    UpdateWindow(g_hWnd);
+bool cubesOverlap(const CubeColumnPointers& c, int i, int j) {
+    float h1 = c.size[i] / 2.0f;
+    float h2 = c.size[j] / 2.0f;
+    return (c.px[i] + h1 > c.px[j] - h2) && (c.px[i] - h1 < c.px[j] + h2)
+        && (c.py[i] + h1 > c.py[j] - h2) && (c.py[i] - h1 < c.py[j] + h2)
+        && (c.pz[i] + h1 > c.pz[j] - h2) && (c.pz[i] - h1 < c.pz[j] + h2);
+}
 
-    ShowCursor(FALSE);
+// Integer counterparts of the kernels above for the lockstep mode. Every
+// operation is exact, so the vector versions match these bit for bit.
+void integrateFixedScalar(const FixedColumnPointers& c, int first, int count, Fixed gravity) {
+    for (int i = first; i < count; ++i) {
+        c.vy[i] -= gravity;
+        c.px[i] += c.vx[i];
+        c.py[i] += c.vy[i];
+        c.pz[i] += c.vz[i];
+    }
+}
 
-    lastFrameTime = std::chrono::high_resolution_clock::now();
+void wallFlagsFixedScalar(const FixedColumnPointers& c, int first, int count, Fixed groundY, Fixed bound, unsigned char* flags) {
+    for (int i = first; i < count; ++i) {
+        Fixed h = c.half[i];
+        unsigned char f = 0;
+        if (c.py[i] - h < groundY) f |= WALL_GROUND;
+        if (c.px[i] - h < -bound) f |= WALL_MIN_X;
+        else if (c.px[i] + h > bound) f |= WALL_MAX_X;
+        if (c.pz[i] - h < -bound) f |= WALL_MIN_Z;
+        else if (c.pz[i] + h > bound) f |= WALL_MAX_Z;
+        flags[i] = f;
+    }
+}
 
-    while (!bQuit) {
-        if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-            if (msg.message == WM_QUIT) {
-                bQuit = TRUE;
-            } else {
-                TranslateMessage(&msg);
-                DispatchMessage(&msg);
-            }
-        } else {
+unsigned overlapTileFixedScalar(const FixedColumnPointers& c, int i, int base) {
+    Fixed h1 = c.half[i];
+    Fixed c1_minX = c.px[i] - h1, c1_maxX = c.px[i] + h1;
+    Fixed c1_minY = c.py[i] - h1, c1_maxY = c.py[i] + h1;
+    Fixed c1_minZ = c.pz[i] - h1, c1_maxZ = c.pz[i] + h1;
+
+    unsigned mask = 0;
+    for (int k = 0; k < PAIR_TILE; ++k) {
+        int j = base + k;
+        Fixed h2 = c.half[j];
+        bool overlapX = (c1_maxX > c.px[j] - h2) & (c1_minX < c.px[j] + h2);
+        bool overlapY = (c1_maxY > c.py[j] - h2) & (c1_minY < c.py[j] + h2);
+        bool overlapZ = (c1_maxZ > c.pz[j] - h2) & (c1_minZ < c.pz[j] + h2);
+        mask |= (unsigned)(overlapX & overlapY & overlapZ) << k;
+    }
+    return mask;
+}
 
-            auto currentTime = std::chrono::high_resolution_clock::now();
-            float deltaTime = std::chrono::duration<float>(currentTime - lastFrameTime).count();
-            lastFrameTime = currentTime;
+// Column-major T * R(q) * S for a unit quaternion q.
+void writeTransform(Matrix4& t, float x, float y, float z, float qw, float qx, float qy, float qz, float scale) {
+    t.m[0] = (1.0f - 2.0f * (qy * qy + qz * qz)) * scale;
+    t.m[1] = 2.0f * (qx * qy + qw * qz) * scale;
+    t.m[2] = 2.0f * (qx * qz - qw * qy) * scale;
+    t.m[3] = 0.0f;
+    t.m[4] = 2.0f * (qx * qy - qw * qz) * scale;
+    t.m[5] = (1.0f - 2.0f * (qx * qx + qz * qz)) * scale;
+    t.m[6] = 2.0f * (qy * qz + qw * qx) * scale;
+    t.m[7] = 0.0f;
+    t.m[8] = 2.0f * (qx * qz + qw * qy) * scale;
+    t.m[9] = 2.0f * (qy * qz - qw * qx) * scale;
+    t.m[10] = (1.0f - 2.0f * (qx * qx + qy * qy)) * scale;
+    t.m[11] = 0.0f;
+    t.m[12] = x;
+    t.m[13] = y;
+    t.m[14] = z;
+    t.m[15] = 1.0f;
+}
 
-            updatePhysics(deltaTime);
+// A cube's inertia is isotropic, so between impacts its angular velocity is
+// constant and the orientation is exactly fromSpin(w, elapsed) * q0. It is
+// evaluated here, in batches, instead of being integrated every step.
+void buildTransformsScalar(const CubeColumnPointers& c, int first, int count, float time, Matrix4* transforms) {
+    for (int i = first; i < count; ++i) {
+        Quat spin = Quat::fromSpin(Vec3(c.wx[i], c.wy[i], c.wz[i]), time - c.rotationTime[i]);
+        Quat q = (spin * Quat(c.qw[i], c.qx[i], c.qy[i], c.qz[i])).renormalized();
+        writeTransform(transforms[i], c.px[i], c.py[i], c.pz[i], q.w, q.x, q.y, q.z, c.size[i] / 2.0f);
+    }
+}
 
-            frameCount++;
-            fpsTimer += deltaTime;
-            if (fpsTimer >= 0.5f) { 
-                float currentFps = (float)frameCount / fpsTimer;
-                if (DEBUG_MODE) { 
-                    std::cout << std::fixed << std::setprecision(2) << "FPS: " << currentFps << std::endl;
-                }
-                frameCount = 0;
-                fpsTimer = 0.0f;
-            }
+// Adds the softened pull of point masses [first, count) on (x, y, z) to
+// acceleration[0..2], in units where the attraction constant is 1.
+void attractScalar(const float* px, const float* py, const float* pz, const float* mass, int first, int count,
+                   float x, float y, float z, float softening, float* acceleration) {
+    for (int i = first; i < count; ++i) {
+        float dx = px[i] - x, dy = py[i] - y, dz = pz[i] - z;
+        float inv = 1.0f / std::sqrt(dx * dx + dy * dy + dz * dz + softening * softening);
+        float s = mass[i] * inv * inv * inv;
+        acceleration[0] += dx * s;
+        acceleration[1] += dy * s;
+        acceleration[2] += dz * s;
+    }
+}
 
-            display();
-            SwapBuffers(g_hDC); 
+// Adds to acceleration[0..2] the contact pushes on a particle with state
+// self = {x, y, z, vx, vy, vz} from particles [first, last). The particle
+// itself may be in the range, as zero distance is skipped.
+void springContactsScalar(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration) {
+    for (int j = first; j < last; ++j) {
+        float dx = self[0] - p.x[j], dy = self[1] - p.y[j], dz = self[2] - p.z[j];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 >= spring.diameter * spring.diameter || d2 == 0.0f) continue;
+        float inv = 1.0f / std::sqrt(d2);
+        float nx = dx * inv, ny = dy * inv, nz = dz * inv;
+        float rvx = self[3] - p.vx[j], rvy = self[4] - p.vy[j], rvz = self[5] - p.vz[j];
+        float vn = rvx * nx + rvy * ny + rvz * nz;
+        float push = std::max(spring.stiffness * (spring.diameter - d2 * inv) - spring.damping * vn, 0.0f);
+        acceleration[0] += nx * push - spring.tangentialDamping * (rvx - nx * vn);
+        acceleration[1] += ny * push - spring.tangentialDamping * (rvy - ny * vn);
+        acceleration[2] += nz * push - spring.tangentialDamping * (rvz - nz * vn);
+    }
+}
+
+// Adds the unnormalised poly6 sum, (h^2 - r^2)^3 over particles [first, last)
+// within h of self = {x, y, z}, to density; the particle itself counts.
+void sphDensityScalar(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density) {
+    float h2 = radius * radius;
+    for (int j = first; j < last; ++j) {
+        float dx = self[0] - p.x[j], dy = self[1] - p.y[j], dz = self[2] - p.z[j];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 >= h2) continue;
+        float w = h2 - d2;
+        *density += w * w * w;
+    }
+}
+
+// Adds pressure and viscosity accelerations from particles [first, last) to
+// a particle with self = {x, y, z, vx, vy, vz, pressure / density^2, 1 / density}.
+void sphForcesScalar(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration) {
+    const ParticleColumns& p = f.p;
+    for (int j = first; j < last; ++j) {
+        float dx = self[0] - p.x[j], dy = self[1] - p.y[j], dz = self[2] - p.z[j];
+        float d2 = dx * dx + dy * dy + dz * dz;
+        if (d2 >= kernel.radius * kernel.radius || d2 == 0.0f) continue;
+        float r = std::sqrt(d2);
+        float w = kernel.radius - r;
+        float push = kernel.pressureScale * (self[6] + f.pressure[j]) * w * w / r;
+        float drag = kernel.viscosityScale * self[7] * f.invDensity[j] * w;
+        acceleration[0] += dx * push + (p.vx[j] - self[3]) * drag;
+        acceleration[1] += dy * push + (p.vy[j] - self[4]) * drag;
+        acceleration[2] += dz * push + (p.vz[j] - self[5]) * drag;
+    }
+}
+
+void integrateScalarKernel(const CubeColumnPointers& c, int count, float deltaTime) { integrateScalar(c, 0, count, deltaTime); }
+void integrateVaryingScalarKernel(const CubeColumnPointers& c, int count, const float* deltaTimes) { integrateVaryingScalar(c, 0, count, deltaTimes); }
+void wallFlagsScalarKernel(const CubeColumnPointers& c, int count, float groundY, float bound, unsigned char* flags) { wallFlagsScalar(c, 0, count, groundY, bound, flags); }
+void buildTransformsScalarKernel(const CubeColumnPointers& c, int count, float time, Matrix4* transforms) { buildTransformsScalar(c, 0, count, time, transforms); }
+void springContactsScalarKernel(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration) {
+    springContactsScalar(p, first, last, self, spring, acceleration);
+}
+void sphDensityScalarKernel(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density) {
+    sphDensityScalar(p, first, last, self, radius, density);
+}
+void sphForcesScalarKernel(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration) {
+    sphForcesScalar(f, first, last, self, kernel, acceleration);
+}
+void attractScalarKernel(const float* px, const float* py, const float* pz, const float* mass, int count, float x, float y, float z, float softening, float* acceleration) {
+    attractScalar(px, py, pz, mass, 0, count, x, y, z, softening, acceleration);
+}
+void integrateFixedScalarKernel(const FixedColumnPointers& c, int count, Fixed gravity) { integrateFixedScalar(c, 0, count, gravity); }
+void wallFlagsFixedScalarKernel(const FixedColumnPointers& c, int count, Fixed groundY, Fixed bound, unsigned char* flags) {
+    wallFlagsFixedScalar(c, 0, count, groundY, bound, flags);
+}
+
+// The vector kernels are written once against GCC vector extensions and
+// instantiated inside functions carrying the matching target attribute, so
+// the baseline i686 code never executes an instruction the CPU lacks. The
+// helpers are always inlined, so the -Wpsabi notes about passing wide vectors
+// by value do not apply; they are reported at the end of the file, which is
+// why the suppression is not popped.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+#define SIMD_INLINE inline __attribute__((always_inline))
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+
+template <int W>
+struct Lanes {
+    static constexpr int width = W;
+    typedef float F __attribute__((vector_size(W * 4)));
+    typedef int I __attribute__((vector_size(W * 4)));
+    typedef unsigned char B __attribute__((vector_size(W)));
+};
+
+template <typename L>
+SIMD_INLINE typename L::F loadLanes(const float* p) {
+    typename L::F v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template <typename L>
+SIMD_INLINE void storeLanes(float* p, typename L::F v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+template <typename L>
+SIMD_INLINE typename L::F splat(float x) {
+    return typename L::F{} + x;
+}
+
+// All-ones where a < b. The sign of (a - b) decides this exactly for the
+// finite values stored in the columns, and unlike a vector compare it does not
+// get split into scalar code for targets the template itself was not built for.
+template <typename L>
+SIMD_INLINE typename L::I lessThan(typename L::F a, typename L::F b) {
+    return (typename L::I)(a - b) >> 31;
+}
+
+template <typename L>
+SIMD_INLINE typename L::F select(typename L::I mask, typename L::F a, typename L::F b) {
+    return (typename L::F)(((typename L::I)a & mask) | ((typename L::I)b & ~mask));
+}
+
+// Bit-trick estimate refined by three Newton steps; finite (not infinite) for
+// zero input, so x * rsqrt(x) is 0 there rather than NaN.
+template <typename L>
+SIMD_INLINE typename L::F rsqrtLanes(typename L::F x) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    F y = (F)(0x5f3759df - ((I)x >> 1));
+    for (int k = 0; k < 3; ++k) {
+        y = y * (1.5f - 0.5f * x * y * y);
+    }
+    return y;
+}
+
+// Cody-Waite reduction to [-pi/4, pi/4] plus the Cephes sinf/cosf polynomials.
+template <typename L>
+SIMD_INLINE void sinCosLanes(typename L::F x, typename L::F& s, typename L::F& c) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    const I signBit = I{} + (int)0x80000000;
+    F half = (F)(((I)x & signBit) | (I)splat<L>(0.5f));
+    I q = __builtin_convertvector(x * (float)M_2_PI + half, I);
+    F qf = __builtin_convertvector(q, F);
+    F r = x - qf * 1.5703125f - qf * 4.837512969970703125e-4f - qf * 7.54978995489188216e-8f;
+    F r2 = r * r;
+    F sr = r + r * r2 * (-1.6666654611e-1f + r2 * (8.3321608736e-3f + r2 * -1.9515295891e-4f));
+    F cr = 1.0f - 0.5f * r2 + r2 * r2 * (4.166664568298827e-2f + r2 * (-1.388731625493765e-3f + r2 * 2.443315711809948e-5f));
+    I odd = -(q & 1);
+    s = (F)((I)select<L>(odd, cr, sr) ^ ((q & 2) << 30));
+    c = (F)((I)select<L>(odd, sr, cr) ^ (((q + 1) & 2) << 30));
+}
+
+template <typename L>
+SIMD_INLINE int integrateLanes(const CubeColumnPointers& c, int count, float deltaTime) {
+    typedef typename L::F F;
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        F vx = loadLanes<L>(c.vx + i), vy = loadLanes<L>(c.vy + i), vz = loadLanes<L>(c.vz + i);
+        vy -= GRAVITY * deltaTime;
+        storeLanes<L>(c.vy + i, vy);
+
+        storeLanes<L>(c.px + i, loadLanes<L>(c.px + i) + vx * deltaTime);
+        storeLanes<L>(c.py + i, loadLanes<L>(c.py + i) + vy * deltaTime);
+        storeLanes<L>(c.pz + i, loadLanes<L>(c.pz + i) + vz * deltaTime);
+    }
+    return i;
+}
+
+template <typename L>
+SIMD_INLINE int integrateVaryingLanes(const CubeColumnPointers& c, int count, const float* deltaTimes) {
+    typedef typename L::F F;
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        F dt = loadLanes<L>(deltaTimes + i);
+        F vx = loadLanes<L>(c.vx + i), vy = loadLanes<L>(c.vy + i), vz = loadLanes<L>(c.vz + i);
+        vy -= GRAVITY * dt;
+        storeLanes<L>(c.vy + i, vy);
+
+        storeLanes<L>(c.px + i, loadLanes<L>(c.px + i) + vx * dt);
+        storeLanes<L>(c.py + i, loadLanes<L>(c.py + i) + vy * dt);
+        storeLanes<L>(c.pz + i, loadLanes<L>(c.pz + i) + vz * dt);
+    }
+    return i;
+}
+
+template <typename L>
+SIMD_INLINE int wallFlagsLanes(const CubeColumnPointers& c, int count, float groundY, float bound, unsigned char* flags) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        F h = loadLanes<L>(c.size + i) / 2.0f;
+        F x = loadLanes<L>(c.px + i), y = loadLanes<L>(c.py + i), z = loadLanes<L>(c.pz + i);
+        I minX = lessThan<L>(x - h, splat<L>(-bound)), maxX = lessThan<L>(splat<L>(bound), x + h);
+        I minZ = lessThan<L>(z - h, splat<L>(-bound)), maxZ = lessThan<L>(splat<L>(bound), z + h);
+        I f = (lessThan<L>(y - h, splat<L>(groundY)) & (int)WALL_GROUND)
+            | (minX & (int)WALL_MIN_X) | (~minX & maxX & (int)WALL_MAX_X)
+            | (minZ & (int)WALL_MIN_Z) | (~minZ & maxZ & (int)WALL_MAX_Z);
+        typename L::B bytes = __builtin_convertvector(f, typename L::B);
+        memcpy(flags + i, &bytes, sizeof(bytes));
+    }
+    return i;
+}
+
+template <typename L>
+SIMD_INLINE typename L::I overlapLanes(const CubeColumnPointers& c, int i, int base) {
+    typedef typename L::F F;
+    float h1 = c.size[i] / 2.0f;
+    float c1_minX = c.px[i] - h1, c1_maxX = c.px[i] + h1;
+    float c1_minY = c.py[i] - h1, c1_maxY = c.py[i] + h1;
+    float c1_minZ = c.pz[i] - h1, c1_maxZ = c.pz[i] + h1;
+
+    F h2 = loadLanes<L>(c.size + base) / 2.0f;
+    F x = loadLanes<L>(c.px + base), y = loadLanes<L>(c.py + base), z = loadLanes<L>(c.pz + base);
+    return lessThan<L>(x - h2, splat<L>(c1_maxX)) & lessThan<L>(splat<L>(c1_minX), x + h2)
+         & lessThan<L>(y - h2, splat<L>(c1_maxY)) & lessThan<L>(splat<L>(c1_minY), y + h2)
+         & lessThan<L>(z - h2, splat<L>(c1_maxZ)) & lessThan<L>(splat<L>(c1_minZ), z + h2);
+}
+
+template <typename L>
+SIMD_INLINE int buildTransformsLanes(const CubeColumnPointers& c, int count, float time, Matrix4* transforms) {
+    typedef typename L::F F;
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        F wx = loadLanes<L>(c.wx + i), wy = loadLanes<L>(c.wy + i), wz = loadLanes<L>(c.wz + i);
+        F rate2 = wx * wx + wy * wy + wz * wz;
+        F invRate = rsqrtLanes<L>(rate2);
+        F half = rate2 * invRate * (time - loadLanes<L>(c.rotationTime + i)) * 0.5f;
+        F sw, cw;
+        sinCosLanes<L>(half, sw, cw);
+        F k = sw * invRate;
+        F sx = wx * k, sy = wy * k, sz = wz * k;
+
+        F bw = loadLanes<L>(c.qw + i), bx = loadLanes<L>(c.qx + i), by = loadLanes<L>(c.qy + i), bz = loadLanes<L>(c.qz + i);
+        F qw = cw * bw - sx * bx - sy * by - sz * bz;
+        F qx = cw * bx + sx * bw + sy * bz - sz * by;
+        F qy = cw * by - sx * bz + sy * bw + sz * bx;
+        F qz = cw * bz + sx * by - sy * bx + sz * bw;
+        F norm = 0.5f * (3.0f - (qw * qw + qx * qx + qy * qy + qz * qz));
+        qw *= norm; qx *= norm; qy *= norm; qz *= norm;
+
+        F x = loadLanes<L>(c.px + i), y = loadLanes<L>(c.py + i), z = loadLanes<L>(c.pz + i);
+        F scale = loadLanes<L>(c.size + i) / 2.0f;
+        for (int k = 0; k < L::width; ++k) {
+            writeTransform(transforms[i + k], x[k], y[k], z[k], qw[k], qx[k], qy[k], qz[k], scale[k]);
         }
     }
+    return i;
+}
 
-    ShowCursor(TRUE);
+template <typename L>
+SIMD_INLINE int attractLanes(const float* px, const float* py, const float* pz, const float* mass, int count,
+                             float x, float y, float z, float softening, float* acceleration) {
+    typedef typename L::F F;
+    F ax{}, ay{}, az{};
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        F dx = loadLanes<L>(px + i) - x, dy = loadLanes<L>(py + i) - y, dz = loadLanes<L>(pz + i) - z;
+        F inv = rsqrtLanes<L>(dx * dx + dy * dy + dz * dz + softening * softening);
+        F s = loadLanes<L>(mass + i) * inv * inv * inv;
+        ax += dx * s;
+        ay += dy * s;
+        az += dz * s;
+    }
+    for (int k = 0; k < L::width; ++k) {
+        acceleration[0] += ax[k];
+        acceleration[1] += ay[k];
+        acceleration[2] += az[k];
+    }
+    return i;
+}
 
-    if (DEBUG_MODE) {
-        FreeConsole();
+template <typename L>
+SIMD_INLINE void springContactsLanes(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    F ax{}, ay{}, az{};
+    F zero{};
+    I lane;
+    for (int k = 0; k < L::width; ++k) lane[k] = k;
+
+    // The last group is partial; lanes at or past `last` read padding or
+    // other particles and are masked out.
+    int j = first;
+    for (; j < last; j += L::width) {
+        I inRange = ((lane + j) - last) >> 31;
+        F dx = self[0] - loadLanes<L>(p.x + j), dy = self[1] - loadLanes<L>(p.y + j), dz = self[2] - loadLanes<L>(p.z + j);
+        F d2 = dx * dx + dy * dy + dz * dz;
+        I touching = inRange & lessThan<L>(d2, splat<L>(spring.diameter * spring.diameter)) & lessThan<L>(zero, d2);
+        F inv = rsqrtLanes<L>(d2);
+        F nx = dx * inv, ny = dy * inv, nz = dz * inv;
+        F rvx = self[3] - loadLanes<L>(p.vx + j), rvy = self[4] - loadLanes<L>(p.vy + j), rvz = self[5] - loadLanes<L>(p.vz + j);
+        F vn = rvx * nx + rvy * ny + rvz * nz;
+        F push = spring.stiffness * (spring.diameter - d2 * inv) - spring.damping * vn;
+        push = select<L>(lessThan<L>(zero, push), push, zero);
+        ax += select<L>(touching, nx * push - spring.tangentialDamping * (rvx - nx * vn), zero);
+        ay += select<L>(touching, ny * push - spring.tangentialDamping * (rvy - ny * vn), zero);
+        az += select<L>(touching, nz * push - spring.tangentialDamping * (rvz - nz * vn), zero);
     }
+    for (int k = 0; k < L::width; ++k) {
+        acceleration[0] += ax[k];
+        acceleration[1] += ay[k];
+        acceleration[2] += az[k];
+    }
+}
 
-    DisableOpenGL(g_hWnd, g_hDC, g_hRC);
+template <typename L>
+SIMD_INLINE void sphDensityLanes(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    F sum{};
+    F zero{};
+    I lane;
+    for (int k = 0; k < L::width; ++k) lane[k] = k;
+
+    for (int j = first; j < last; j += L::width) {
+        I inRange = ((lane + j) - last) >> 31;
+        F dx = self[0] - loadLanes<L>(p.x + j), dy = self[1] - loadLanes<L>(p.y + j), dz = self[2] - loadLanes<L>(p.z + j);
+        F w = radius * radius - (dx * dx + dy * dy + dz * dz);
+        sum += select<L>(inRange & lessThan<L>(zero, w), w * w * w, zero);
+    }
+    for (int k = 0; k < L::width; ++k) *density += sum[k];
+}
 
-    DestroyWindow(g_hWnd);
+template <typename L>
+SIMD_INLINE void sphForcesLanes(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    const ParticleColumns& p = f.p;
+    F ax{}, ay{}, az{};
+    F zero{};
+    I lane;
+    for (int k = 0; k < L::width; ++k) lane[k] = k;
+
+    for (int j = first; j < last; j += L::width) {
+        I inRange = ((lane + j) - last) >> 31;
+        F dx = self[0] - loadLanes<L>(p.x + j), dy = self[1] - loadLanes<L>(p.y + j), dz = self[2] - loadLanes<L>(p.z + j);
+        F d2 = dx * dx + dy * dy + dz * dz;
+        I near = inRange & lessThan<L>(d2, splat<L>(kernel.radius * kernel.radius)) & lessThan<L>(zero, d2);
+        F inv = rsqrtLanes<L>(d2);
+        F w = kernel.radius - d2 * inv;
+        F push = kernel.pressureScale * (self[6] + loadLanes<L>(f.pressure + j)) * w * w * inv;
+        F drag = kernel.viscosityScale * self[7] * loadLanes<L>(f.invDensity + j) * w;
+        push = select<L>(near, push, zero);
+        drag = select<L>(near, drag, zero);
+        ax += dx * push + (loadLanes<L>(p.vx + j) - self[3]) * drag;
+        ay += dy * push + (loadLanes<L>(p.vy + j) - self[4]) * drag;
+        az += dz * push + (loadLanes<L>(p.vz + j) - self[5]) * drag;
+    }
+    for (int k = 0; k < L::width; ++k) {
+        acceleration[0] += ax[k];
+        acceleration[1] += ay[k];
+        acceleration[2] += az[k];
+    }
+}
 
-    UnregisterClass("OpenGLWinClass", hInstance);
+template <typename L>
+SIMD_INLINE typename L::I loadFixedLanes(const Fixed* p) {
+    typename L::I v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-    return msg.wParam;
+template <typename L>
+SIMD_INLINE void storeFixedLanes(Fixed* p, typename L::I v) {
+    memcpy(p, &v, sizeof(v));
 }
 
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
-    switch (message) {
-        case WM_CREATE:
-            break;
+// lessThan for Q16.16 lanes. Live coordinates and the padding value stay
+// far enough inside the int32 range that the difference cannot wrap.
+template <typename L>
+SIMD_INLINE typename L::I lessThanFixed(typename L::I a, typename L::I b) {
+    return (a - b) >> 31;
+}
 
-        case WM_SIZE:
+template <typename L>
+SIMD_INLINE int integrateFixedLanes(const FixedColumnPointers& c, int count, Fixed gravity) {
+    typedef typename L::I I;
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        I vy = loadFixedLanes<L>(c.vy + i) - gravity;
+        storeFixedLanes<L>(c.vy + i, vy);
+
+        storeFixedLanes<L>(c.px + i, loadFixedLanes<L>(c.px + i) + loadFixedLanes<L>(c.vx + i));
+        storeFixedLanes<L>(c.py + i, loadFixedLanes<L>(c.py + i) + vy);
+        storeFixedLanes<L>(c.pz + i, loadFixedLanes<L>(c.pz + i) + loadFixedLanes<L>(c.vz + i));
+    }
+    return i;
+}
 
-            reshape(LOWORD(lParam), HIWORD(lParam));
-            break;
+template <typename L>
+SIMD_INLINE int wallFlagsFixedLanes(const FixedColumnPointers& c, int count, Fixed groundY, Fixed bound, unsigned char* flags) {
+    typedef typename L::I I;
+    int i = 0;
+    for (; i + L::width <= count; i += L::width) {
+        I h = loadFixedLanes<L>(c.half + i);
+        I x = loadFixedLanes<L>(c.px + i), y = loadFixedLanes<L>(c.py + i), z = loadFixedLanes<L>(c.pz + i);
+        I low = I{} - bound, high = I{} + bound;
+        I minX = lessThanFixed<L>(x - h, low), maxX = lessThanFixed<L>(high, x + h);
+        I minZ = lessThanFixed<L>(z - h, low), maxZ = lessThanFixed<L>(high, z + h);
+        I f = (lessThanFixed<L>(y - h, I{} + groundY) & (int)WALL_GROUND)
+            | (minX & (int)WALL_MIN_X) | (~minX & maxX & (int)WALL_MAX_X)
+            | (minZ & (int)WALL_MIN_Z) | (~minZ & maxZ & (int)WALL_MAX_Z);
+        typename L::B bytes = __builtin_convertvector(f, typename L::B);
+        memcpy(flags + i, &bytes, sizeof(bytes));
+    }
+    return i;
+}
 
-        case WM_PAINT:
-            ValidateRect(hWnd, NULL);
-            break;
+template <typename L>
+SIMD_INLINE typename L::I overlapFixedLanes(const FixedColumnPointers& c, int i, int base) {
+    typedef typename L::I I;
+    Fixed h1 = c.half[i];
+    Fixed c1_minX = c.px[i] - h1, c1_maxX = c.px[i] + h1;
+    Fixed c1_minY = c.py[i] - h1, c1_maxY = c.py[i] + h1;
+    Fixed c1_minZ = c.pz[i] - h1, c1_maxZ = c.pz[i] + h1;
+
+    I h2 = loadFixedLanes<L>(c.half + base);
+    I x = loadFixedLanes<L>(c.px + base), y = loadFixedLanes<L>(c.py + base), z = loadFixedLanes<L>(c.pz + base);
+    return lessThanFixed<L>(x - h2, I{} + c1_maxX) & lessThanFixed<L>(I{} + c1_minX, x + h2)
+         & lessThanFixed<L>(y - h2, I{} + c1_maxY) & lessThanFixed<L>(I{} + c1_minY, y + h2)
+         & lessThanFixed<L>(z - h2, I{} + c1_maxZ) & lessThanFixed<L>(I{} + c1_minZ, z + h2);
+}
 
-        case WM_KEYDOWN:
-            switch (wParam) {
-                case VK_ESCAPE:
+TARGET_SSE2 void integrateSse2(const CubeColumnPointers& c, int count, float deltaTime) {
+    integrateScalar(c, integrateLanes<Lanes<4>>(c, count, deltaTime), count, deltaTime);
+}
+
+TARGET_SSE2 void integrateVaryingSse2(const CubeColumnPointers& c, int count, const float* deltaTimes) {
+    integrateVaryingScalar(c, integrateVaryingLanes<Lanes<4>>(c, count, deltaTimes), count, deltaTimes);
+}
+
+TARGET_SSE2 void wallFlagsSse2(const CubeColumnPointers& c, int count, float groundY, float bound, unsigned char* flags) {
+    wallFlagsScalar(c, wallFlagsLanes<Lanes<4>>(c, count, groundY, bound, flags), count, groundY, bound, flags);
+}
+
+TARGET_SSE2 unsigned overlapTileSse2(const CubeColumnPointers& c, int i, int base) {
+    unsigned mask = 0;
+    for (int k = 0; k < PAIR_TILE; k += 4) {
+        mask |= (unsigned)_mm_movemask_ps((__m128)overlapLanes<Lanes<4>>(c, i, base + k)) << k;
+    }
+    return mask;
+}
+
+TARGET_SSE2 void buildTransformsSse2(const CubeColumnPointers& c, int count, float time, Matrix4* transforms) {
+    buildTransformsScalar(c, buildTransformsLanes<Lanes<4>>(c, count, time, transforms), count, time, transforms);
+}
+
+// The particle kernels mask their last group, so the lanes cover the whole
+// range. They run once per neighbour row; GCC leaves the upper halves of the
+// vector registers dirty on the way out, which slows every SSE instruction in
+// the caller, so the AVX versions clear them explicitly.
+TARGET_SSE2 void springContactsSse2(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration) {
+    springContactsLanes<Lanes<4>>(p, first, last, self, spring, acceleration);
+}
+
+TARGET_SSE2 void sphDensitySse2(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density) {
+    sphDensityLanes<Lanes<4>>(p, first, last, self, radius, density);
+}
+
+TARGET_SSE2 void sphForcesSse2(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration) {
+    sphForcesLanes<Lanes<4>>(f, first, last, self, kernel, acceleration);
+}
+
+TARGET_SSE2 void attractSse2(const float* px, const float* py, const float* pz, const float* mass, int count, float x, float y, float z, float softening, float* acceleration) {
+    attractScalar(px, py, pz, mass, attractLanes<Lanes<4>>(px, py, pz, mass, count, x, y, z, softening, acceleration), count, x, y, z, softening, acceleration);
+}
+
+TARGET_SSE2 void integrateFixedSse2(const FixedColumnPointers& c, int count, Fixed gravity) {
+    integrateFixedScalar(c, integrateFixedLanes<Lanes<4>>(c, count, gravity), count, gravity);
+}
+
+TARGET_SSE2 void wallFlagsFixedSse2(const FixedColumnPointers& c, int count, Fixed groundY, Fixed bound, unsigned char* flags) {
+    wallFlagsFixedScalar(c, wallFlagsFixedLanes<Lanes<4>>(c, count, groundY, bound, flags), count, groundY, bound, flags);
+}
+
+TARGET_SSE2 unsigned overlapTileFixedSse2(const FixedColumnPointers& c, int i, int base) {
+    unsigned mask = 0;
+    for (int k = 0; k < PAIR_TILE; k += 4) {
+        mask |= (unsigned)_mm_movemask_ps((__m128)overlapFixedLanes<Lanes<4>>(c, i, base + k)) << k;
+    }
+    return mask;
+}
+
+TARGET_AVX2 void integrateAvx2(const CubeColumnPointers& c, int count, float deltaTime) {
+    integrateScalar(c, integrateLanes<Lanes<8>>(c, count, deltaTime), count, deltaTime);
+}
+
+TARGET_AVX2 void integrateVaryingAvx2(const CubeColumnPointers& c, int count, const float* deltaTimes) {
+    integrateVaryingScalar(c, integrateVaryingLanes<Lanes<8>>(c, count, deltaTimes), count, deltaTimes);
+}
+
+TARGET_AVX2 void wallFlagsAvx2(const CubeColumnPointers& c, int count, float groundY, float bound, unsigned char* flags) {
+    wallFlagsScalar(c, wallFlagsLanes<Lanes<8>>(c, count, groundY, bound, flags), count, groundY, bound, flags);
+}
+
+TARGET_AVX2 unsigned overlapTileAvx2(const CubeColumnPointers& c, int i, int base) {
+    unsigned mask = 0;
+    for (int k = 0; k < PAIR_TILE; k += 8) {
+        mask |= (unsigned)_mm256_movemask_ps((__m256)overlapLanes<Lanes<8>>(c, i, base + k)) << k;
+    }
+    return mask;
+}
+
+TARGET_AVX2 void buildTransformsAvx2(const CubeColumnPointers& c, int count, float time, Matrix4* transforms) {
+    buildTransformsScalar(c, buildTransformsLanes<Lanes<8>>(c, count, time, transforms), count, time, transforms);
+}
+
+TARGET_AVX2 void springContactsAvx2(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration) {
+    springContactsLanes<Lanes<8>>(p, first, last, self, spring, acceleration);
+    _mm256_zeroupper();
+}
+
+TARGET_AVX2 void sphDensityAvx2(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density) {
+    sphDensityLanes<Lanes<8>>(p, first, last, self, radius, density);
+    _mm256_zeroupper();
+}
+
+TARGET_AVX2 void sphForcesAvx2(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration) {
+    sphForcesLanes<Lanes<8>>(f, first, last, self, kernel, acceleration);
+    _mm256_zeroupper();
+}
+
+TARGET_AVX2 void attractAvx2(const float* px, const float* py, const float* pz, const float* mass, int count, float x, float y, float z, float softening, float* acceleration) {
+    attractScalar(px, py, pz, mass, attractLanes<Lanes<8>>(px, py, pz, mass, count, x, y, z, softening, acceleration), count, x, y, z, softening, acceleration);
+}
+
+TARGET_AVX2 void integrateFixedAvx2(const FixedColumnPointers& c, int count, Fixed gravity) {
+    integrateFixedScalar(c, integrateFixedLanes<Lanes<8>>(c, count, gravity), count, gravity);
+}
+
+TARGET_AVX2 void wallFlagsFixedAvx2(const FixedColumnPointers& c, int count, Fixed groundY, Fixed bound, unsigned char* flags) {
+    wallFlagsFixedScalar(c, wallFlagsFixedLanes<Lanes<8>>(c, count, groundY, bound, flags), count, groundY, bound, flags);
+}
+
+TARGET_AVX2 unsigned overlapTileFixedAvx2(const FixedColumnPointers& c, int i, int base) {
+    unsigned mask = 0;
+    for (int k = 0; k < PAIR_TILE; k += 8) {
+        mask |= (unsigned)_mm256_movemask_ps((__m256)overlapFixedLanes<Lanes<8>>(c, i, base + k)) << k;
+    }
+    return mask;
+}
+
+TARGET_AVX512 void integrateAvx512(const CubeColumnPointers& c, int count, float deltaTime) {
+    integrateScalar(c, integrateLanes<Lanes<16>>(c, count, deltaTime), count, deltaTime);
+}
+
+TARGET_AVX512 void integrateVaryingAvx512(const CubeColumnPointers& c, int count, const float* deltaTimes) {
+    integrateVaryingScalar(c, integrateVaryingLanes<Lanes<16>>(c, count, deltaTimes), count, deltaTimes);
+}
+
+TARGET_AVX512 void wallFlagsAvx512(const CubeColumnPointers& c, int count, float groundY, float bound, unsigned char* flags) {
+    wallFlagsScalar(c, wallFlagsLanes<Lanes<16>>(c, count, groundY, bound, flags), count, groundY, bound, flags);
+}
+
+TARGET_AVX512 unsigned overlapTileAvx512(const CubeColumnPointers& c, int i, int base) {
+    return _mm512_movepi32_mask((__m512i)overlapLanes<Lanes<16>>(c, i, base));
+}
+
+TARGET_AVX512 void buildTransformsAvx512(const CubeColumnPointers& c, int count, float time, Matrix4* transforms) {
+    buildTransformsScalar(c, buildTransformsLanes<Lanes<16>>(c, count, time, transforms), count, time, transforms);
+}
+
+TARGET_AVX512 void springContactsAvx512(const ParticleColumns& p, int first, int last, const float* self, const SpringContact& spring, float* acceleration) {
+    springContactsLanes<Lanes<16>>(p, first, last, self, spring, acceleration);
+    _mm256_zeroupper();
+}
+
+TARGET_AVX512 void sphDensityAvx512(const ParticleColumns& p, int first, int last, const float* self, float radius, float* density) {
+    sphDensityLanes<Lanes<16>>(p, first, last, self, radius, density);
+    _mm256_zeroupper();
+}
+
+TARGET_AVX512 void sphForcesAvx512(const FluidColumns& f, int first, int last, const float* self, const SphKernel& kernel, float* acceleration) {
+    sphForcesLanes<Lanes<16>>(f, first, last, self, kernel, acceleration);
+    _mm256_zeroupper();
+}
+
+TARGET_AVX512 void attractAvx512(const float* px, const float* py, const float* pz, const float* mass, int count, float x, float y, float z, float softening, float* acceleration) {
+    attractScalar(px, py, pz, mass, attractLanes<Lanes<16>>(px, py, pz, mass, count, x, y, z, softening, acceleration), count, x, y, z, softening, acceleration);
+}
+
+TARGET_AVX512 void integrateFixedAvx512(const FixedColumnPointers& c, int count, Fixed gravity) {
+    integrateFixedScalar(c, integrateFixedLanes<Lanes<16>>(c, count, gravity), count, gravity);
+}
+
+TARGET_AVX512 void wallFlagsFixedAvx512(const FixedColumnPointers& c, int count, Fixed groundY, Fixed bound, unsigned char* flags) {
+    wallFlagsFixedScalar(c, wallFlagsFixedLanes<Lanes<16>>(c, count, groundY, bound, flags), count, groundY, bound, flags);
+}
+
+TARGET_AVX512 unsigned overlapTileFixedAvx512(const FixedColumnPointers& c, int i, int base) {
+    return _mm512_movepi32_mask((__m512i)overlapFixedLanes<Lanes<16>>(c, i, base));
+}
+
+// The packet traversal walks BoxTree, so these are defined after it.
+void castPacketScalar(const BoxTree& tree, RayPacket& packet);
+TARGET_SSE2 void castPacketSse2(const BoxTree& tree, RayPacket& packet);
+TARGET_AVX2 void castPacketAvx2(const BoxTree& tree, RayPacket& packet);
+TARGET_AVX512 void castPacketAvx512(const BoxTree& tree, RayPacket& packet);
+
+const SimdKernels KERNELS_SCALAR = {CpuIsa::Scalar, "scalar", integrateScalarKernel, integrateVaryingScalarKernel, wallFlagsScalarKernel, overlapTileScalar, buildTransformsScalarKernel, attractScalarKernel, springContactsScalarKernel, sphDensityScalarKernel, sphForcesScalarKernel, integrateFixedScalarKernel, wallFlagsFixedScalarKernel, overlapTileFixedScalar, castPacketScalar};
+const SimdKernels KERNELS_SSE2 = {CpuIsa::SSE2, "sse2", integrateSse2, integrateVaryingSse2, wallFlagsSse2, overlapTileSse2, buildTransformsSse2, attractSse2, springContactsSse2, sphDensitySse2, sphForcesSse2, integrateFixedSse2, wallFlagsFixedSse2, overlapTileFixedSse2, castPacketSse2};
+const SimdKernels KERNELS_AVX2 = {CpuIsa::AVX2, "avx2", integrateAvx2, integrateVaryingAvx2, wallFlagsAvx2, overlapTileAvx2, buildTransformsAvx2, attractAvx2, springContactsAvx2, sphDensityAvx2, sphForcesAvx2, integrateFixedAvx2, wallFlagsFixedAvx2, overlapTileFixedAvx2, castPacketAvx2};
+const SimdKernels KERNELS_AVX512 = {CpuIsa::AVX512, "avx512", integrateAvx512, integrateVaryingAvx512, wallFlagsAvx512, overlapTileAvx512, buildTransformsAvx512, attractAvx512, springContactsAvx512, sphDensityAvx512, sphForcesAvx512, integrateFixedAvx512, wallFlagsFixedAvx512, overlapTileFixedAvx512, castPacketAvx512};
+
+SimdKernels simd = KERNELS_SCALAR;
+
+CpuIsa detectCpuIsa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl")) return CpuIsa::AVX512;
+    if (__builtin_cpu_supports("avx2")) return CpuIsa::AVX2;
+    if (__builtin_cpu_supports("sse2")) return CpuIsa::SSE2;
+    return CpuIsa::Scalar;
+}
+
+// "--isa=scalar|sse2|avx2|avx512" on the command line caps the kernels used,
+// so every code path can be exercised on a single machine.
+CpuIsa parseIsaOverride(const char* cmdLine, CpuIsa fallback) {
+    const char* arg = cmdLine ? strstr(cmdLine, "--isa=") : NULL;
+    if (!arg) return fallback;
+    arg += strlen("--isa=");
+    if (strncmp(arg, "scalar", 6) == 0) return CpuIsa::Scalar;
+    if (strncmp(arg, "sse2", 4) == 0) return CpuIsa::SSE2;
+    if (strncmp(arg, "avx2", 4) == 0) return CpuIsa::AVX2;
+    if (strncmp(arg, "avx512", 6) == 0) return CpuIsa::AVX512;
+    return fallback;
+}
+
+void selectKernels(const char* cmdLine) {
+    CpuIsa supported = detectCpuIsa();
+    CpuIsa requested = parseIsaOverride(cmdLine, supported);
+    CpuIsa isa = std::min(requested, supported);
+
+    switch (isa) {
+        case CpuIsa::AVX512: simd = KERNELS_AVX512; break;
+        case CpuIsa::AVX2: simd = KERNELS_AVX2; break;
+        case CpuIsa::SSE2: simd = KERNELS_SSE2; break;
+        default: simd = KERNELS_SCALAR; break;
+    }
+
+    if (DEBUG_MODE) {
+        if (requested > supported) {
+            std::cout << "Requested ISA is not supported by this CPU, falling back." << std::endl;
+        }
+        std::cout << "Physics kernels: " << simd.name << std::endl;
+    }
+}
+
+// One body's persistent state, for bodies held outside the world's columns.
+// Positions are relative to an origin chosen by the holder.
+struct BodyRecord {
+    float px, py, pz;
+    float vx, vy, vz;
+    float wx, wy, wz;
+    float qw, qx, qy, qz;
+    float rotationTime;
+    float size;
+    float invMass;
+    float invInertia;
+    unsigned layer, mask;
+    unsigned char shape;
+};
+
+// Gathers column[order[k]] into slot k.
+template <typename Column>
+void permuteColumn(Column& column, const int* order, int count) {
+    using T = typename std::remove_reference<decltype(column[0])>::type;
+    static std::vector<T> scratch;
+    scratch.resize(count);
+    for (int k = 0; k < count; ++k) {
+        scratch[k] = column[order[k]];
+    }
+    std::copy(scratch.begin(), scratch.end(), column.begin());
+}
+
+template <template <typename> class Column>
+struct CubeColumns {
+    Column<float> px, py, pz;
+    Column<float> vx, vy, vz;
+    Column<float> wx, wy, wz;
+    Column<float> qw, qx, qy, qz;
+    Column<float> rotationTime;
+    Column<float> size;
+    Column<float> invMass;
+    Column<float> invInertia;
+    Column<float> restTime;
+    Column<float> pendingDt;
+    Column<float> stepDt;
+    Column<unsigned> layer;
+    Column<unsigned> mask;
+    Column<unsigned char> shape;
+    Column<unsigned char> rateLevel;
+    Column<unsigned char> due;
+    Column<unsigned char> deferredSteps;
+    Column<unsigned char> resting;
+    Column<unsigned char> wallFlags;
+    Column<Matrix4> transform;
+
+    CubeColumnPointers pointers() {
+        return {px.data(), py.data(), pz.data(), vx.data(), vy.data(), vz.data(),
+                wx.data(), wy.data(), wz.data(), qw.data(), qx.data(), qy.data(), qz.data(), rotationTime.data(), size.data(),
+                layer.data(), mask.data()};
+    }
+
+    Vec3 position(int i) const { return Vec3(px[i], py[i], pz[i]); }
+    Vec3 velocity(int i) const { return Vec3(vx[i], vy[i], vz[i]); }
+    Vec3 angularVelocity(int i) const { return Vec3(wx[i], wy[i], wz[i]); }
+
+    Quat orientationAt(int i, float time) const {
+        Quat base(qw[i], qx[i], qy[i], qz[i]);
+        return (Quat::fromSpin(angularVelocity(i), time - rotationTime[i]) * base).renormalized();
+    }
+
+    void setPosition(int i, const Vec3& p) { px[i] = p.x; py[i] = p.y; pz[i] = p.z; }
+    void setVelocity(int i, const Vec3& v) { vx[i] = v.x; vy[i] = v.y; vz[i] = v.z; }
+
+    // Orientation is stored as the quaternion reached at rotationTime plus a
+    // constant angular velocity, so a new spin first folds the elapsed turn
+    // into the base.
+    void setSpin(int i, const Vec3& w, float time) {
+        if (wx[i] == w.x && wy[i] == w.y && wz[i] == w.z) return;
+        Quat q = orientationAt(i, time);
+        qw[i] = q.w; qx[i] = q.x; qy[i] = q.y; qz[i] = q.z;
+        rotationTime[i] = time;
+        wx[i] = w.x; wy[i] = w.y; wz[i] = w.z;
+    }
+
+    void resetRotation(int i) {
+        qw[i] = 1.0f;
+        qx[i] = qy[i] = qz[i] = 0.0f;
+        wx[i] = wy[i] = wz[i] = 0.0f;
+        rotationTime[i] = 0.0f;
+    }
+
+    // Spheres and capsules use a single scalar inertia as well; for the
+    // capsule it is the mean of its axial and transverse moments.
+    void setMassFromSize(int i) {
+        const float pi = 3.14159265f;
+        float mass, inertia;
+        if (shape[i] == SHAPE_SPHERE) {
+            float radius = size[i] / 2.0f;
+            mass = CUBE_DENSITY * 4.0f / 3.0f * pi * radius * radius * radius;
+            inertia = 0.4f * mass * radius * radius;
+        } else if (shape[i] == SHAPE_CAPSULE) {
+            float radius = size[i] / 4.0f, length = size[i] / 2.0f;
+            mass = CUBE_DENSITY * pi * radius * radius * (length + 4.0f / 3.0f * radius);
+            float axial = 0.5f * mass * radius * radius;
+            float transverse = mass * (3.0f * radius * radius + length * length) / 12.0f + mass * 0.25f * length * length;
+            inertia = (axial + 2.0f * transverse) / 3.0f;
+        } else {
+            mass = CUBE_DENSITY * size[i] * size[i] * size[i];
+            invMass[i] = 1.0f / mass;
+            invInertia[i] = boxInverseInertia(size[i], mass);
+            return;
+        }
+        invMass[i] = 1.0f / mass;
+        invInertia[i] = 1.0f / inertia;
+    }
+
+    // wallFlags and transform are rebuilt every step and frame, so they are
+    // not carried along.
+    void reorder(const int* order, int count) {
+        for (auto* column : {&px, &py, &pz, &vx, &vy, &vz, &wx, &wy, &wz, &qw, &qx, &qy, &qz, &rotationTime, &size, &invMass, &invInertia, &restTime, &pendingDt}) {
+            permuteColumn(*column, order, count);
+        }
+        permuteColumn(layer, order, count);
+        permuteColumn(mask, order, count);
+        permuteColumn(shape, order, count);
+        permuteColumn(rateLevel, order, count);
+        permuteColumn(deferredSteps, order, count);
+        permuteColumn(resting, order, count);
+    }
+
+    BodyRecord record(int i, const Vec3& origin) const {
+        return {px[i] - origin.x, py[i] - origin.y, pz[i] - origin.z,
+                vx[i], vy[i], vz[i], wx[i], wy[i], wz[i],
+                qw[i], qx[i], qy[i], qz[i], rotationTime[i], size[i], invMass[i], invInertia[i], layer[i], mask[i], shape[i]};
+    }
+
+    void restore(int i, const BodyRecord& r, const Vec3& origin) {
+        px[i] = origin.x + r.px; py[i] = origin.y + r.py; pz[i] = origin.z + r.pz;
+        vx[i] = r.vx; vy[i] = r.vy; vz[i] = r.vz;
+        wx[i] = r.wx; wy[i] = r.wy; wz[i] = r.wz;
+        qw[i] = r.qw; qx[i] = r.qx; qy[i] = r.qy; qz[i] = r.qz;
+        rotationTime[i] = r.rotationTime;
+        size[i] = r.size;
+        invMass[i] = r.invMass;
+        invInertia[i] = r.invInertia;
+        layer[i] = r.layer;
+        mask[i] = r.mask;
+        shape[i] = r.shape;
+        restTime[i] = 0.0f;
+        pendingDt[i] = 0.0f;
+        rateLevel[i] = 0;
+        deferredSteps[i] = 0;
+    }
+
+    // Slots past count() up to the tile-rounded capacity never overlap anything,
+    // so the pair kernel can always test whole tiles.
+    void clearPadding(int first, int last) {
+        for (int i = first; i < last; ++i) {
+            px[i] = py[i] = pz[i] = PADDING_POSITION;
+            size[i] = 0.0f;
+            layer[i] = mask[i] = 0;
+        }
+    }
+};
+
+constexpr int tileRoundUp(int n) { return (n + PAIR_TILE - 1) / PAIR_TILE * PAIR_TILE; }
+
+constexpr Vec3 spawnSlot(int i) {
+    return Vec3((i % 10 - 5.0f) * (CUBE_SIZE * 2.0f),
+                (i / 100) * (CUBE_SIZE * 2.0f),
+                ((i / 10) % 10 - 5.0f) * (CUBE_SIZE * 2.0f));
+}
+
+template <int N>
+constexpr std::array<Vec3, N> spawnLayout() {
+    std::array<Vec3, N> layout{};
+    for (int i = 0; i < N; ++i) {
+        layout[i] = spawnSlot(i);
+    }
+    return layout;
+}
+
+template <int N>
+struct FixedColumns {
+    template <typename T> using Column = std::array<T, tileRoundUp(N)>;
+};
+
+// Heap-free world for small scenes: the body count is a compile-time constant,
+// so every per-body loop and the pair tiles can be fully unrolled.
+template <int N>
+struct World : CubeColumns<FixedColumns<N>::template Column> {
+    static constexpr bool fixedCapacity = true;
+    static constexpr std::array<Vec3, N> spawnSlots = spawnLayout<N>();
+
+    static constexpr int count() { return N; }
+    void resize(int) { this->clearPadding(N, tileRoundUp(N)); }
+    Vec3 spawnPosition(int i) const { return spawnSlots[i]; }
+};
+
+template <typename T> using HeapColumn = std::vector<T>;
+
+struct DynamicWorld : CubeColumns<HeapColumn> {
+    static constexpr bool fixedCapacity = false;
+    int bodyCount = 0;
+
+    int count() const { return bodyCount; }
+
+    void resize(int n) {
+        int capacity = tileRoundUp(n);
+        for (auto* column : {&px, &py, &pz, &vx, &vy, &vz, &wx, &wy, &wz, &qw, &qx, &qy, &qz, &rotationTime, &size, &invMass, &invInertia, &restTime, &pendingDt, &stepDt}) {
+            column->resize(capacity);
+        }
+        layer.resize(capacity);
+        mask.resize(capacity);
+        shape.resize(capacity);
+        rateLevel.resize(capacity);
+        due.resize(capacity);
+        deferredSteps.resize(capacity);
+        resting.resize(capacity);
+        wallFlags.resize(capacity);
+        transform.resize(capacity);
+        bodyCount = n;
+        clearPadding(n, capacity);
+    }
+
+    Vec3 spawnPosition(int i) const { return spawnSlot(i); }
+
+    int append(const BodyRecord& r, const Vec3& origin) {
+        int i = bodyCount;
+        resize(bodyCount + 1);
+        restore(i, r, origin);
+        resting[i] = false;
+        return i;
+    }
+
+    // Keeps only the listed bodies, in that order.
+    void compact(const std::vector<int>& keep) {
+        reorder(keep.data(), (int)keep.size());
+        resize((int)keep.size());
+    }
+};
+
+// Paging and consolidation add and remove bodies at run time, so they need
+// the heap world.
+using SceneWorld = std::conditional<NUM_CUBES <= FIXED_WORLD_MAX_CUBES && !PAGE_SLEEPING_REGIONS && !CONSOLIDATE_PILES,
+                                    World<NUM_CUBES>, DynamicWorld>::type;
+
+SceneWorld world;
+
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
+void EnableOpenGL(HWND hWnd, HDC* hDC, HGLRC* hRC);
+void DisableOpenGL(HWND hWnd, HDC hDC, HGLRC hRC);
+void initOpenGL();
+void display();
+void reshape(int width, int height);
+void resetCubes();
+void updatePhysics(float deltaTime);
+void drawCube(const Matrix4& transform);
+void drawShape(unsigned char shape, const Matrix4& transform);
+void clearRegionPaging();
+void clearCompounds();
+void shutdownRegionPaging();
+void restartBroadphaseTuner();
+void shutdownWorkers();
+void resetGranular();
+void drawGranular();
+void resetFluid();
+void drawFluid();
+void resetLockstep();
+void drawLockstep();
+void resetContactEvents();
+void shutdownScenePreparer();
+
+int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow) {
+    WNDCLASS wc;
+    MSG msg;
+    BOOL bQuit = FALSE;
+
+    g_hInstance = hInstance; 
+
+    if (DEBUG_MODE) {
+        AllocConsole();
+        HANDLE handle_out = GetStdHandle(STD_OUTPUT_HANDLE);
+        int hCrt = _open_osfhandle((intptr_t)handle_out, _O_TEXT);
+        FILE* hf_out = _fdopen(hCrt, "w");
+        setvbuf(hf_out, NULL, _IONBF, 1);
+        *stdout = *hf_out;
+        std::cout.clear();
+    }
+
+    selectKernels(lpCmdLine);
+
+    wc.style = CS_OWNDC;
+    wc.lpfnWndProc = WndProc;
+    wc.cbClsExtra = 0;
+    wc.cbWndExtra = 0;
+    wc.hInstance = hInstance;
+    wc.hIcon = LoadIcon(NULL, IDI_APPLICATION);
+    wc.hCursor = LoadCursor(NULL, IDC_ARROW);
+    wc.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
+    wc.lpszMenuName = NULL;
+    wc.lpszClassName = "OpenGLWinClass";
+    RegisterClass(&wc);
+
+    int screenWidth = GetSystemMetrics(SM_CXSCREEN);
+    int screenHeight = GetSystemMetrics(SM_CYSCREEN);
+
+    g_hWnd = CreateWindowEx(
+        0,
+        "OpenGLWinClass",
+        "",
+        WS_POPUP | WS_VISIBLE, 
+        0, 
+        0, 
+        screenWidth, 
+        screenHeight, 
+        NULL,
+        NULL,
+        hInstance,
+        NULL);
+
+    if (!g_hWnd) {
+        MessageBox(NULL, "Window Creation Failed!", "Error", MB_OK | MB_ICONERROR);
+        return 0;
+    }
+
+    EnableOpenGL(g_hWnd, &g_hDC, &g_hRC);
+
+    initOpenGL();
+
+    UpdateWindow(g_hWnd);
+
+    ShowCursor(FALSE);
+
+    lastFrameTime = std::chrono::high_resolution_clock::now();
+
+    while (!bQuit) {
+        if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            if (msg.message == WM_QUIT) {
+                bQuit = TRUE;
+            } else {
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+            }
+        } else {
+
+            auto currentTime = std::chrono::high_resolution_clock::now();
+            float deltaTime = std::chrono::duration<float>(currentTime - lastFrameTime).count();
+            lastFrameTime = currentTime;
+
+            updatePhysics(deltaTime);
+
+            frameCount++;
+            fpsTimer += deltaTime;
+            if (fpsTimer >= 0.5f) { 
+                float currentFps = (float)frameCount / fpsTimer;
+                if (DEBUG_MODE) { 
+                    std::cout << std::fixed << std::setprecision(2) << "FPS: " << currentFps << std::endl;
+                }
+                frameCount = 0;
+                fpsTimer = 0.0f;
+            }
+
+            display();
+            SwapBuffers(g_hDC); 
+        }
+    }
+
+    ShowCursor(TRUE);
+
+    if (DEBUG_MODE) {
+        FreeConsole();
+    }
+
+    shutdownRegionPaging();
+    shutdownScenePreparer();
+    shutdownWorkers();
+
+    gluDeleteQuadric(quadric);
+    DisableOpenGL(g_hWnd, g_hDC, g_hRC);
+
+    DestroyWindow(g_hWnd);
+
+    UnregisterClass("OpenGLWinClass", hInstance);
+
+    return msg.wParam;
+}
+
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    switch (message) {
+        case WM_CREATE:
+            break;
+
+        case WM_SIZE:
+
+            reshape(LOWORD(lParam), HIWORD(lParam));
+            break;
+
+        case WM_PAINT:
+            ValidateRect(hWnd, NULL);
+            break;
+
+        case WM_KEYDOWN:
+            switch (wParam) {
+                case VK_ESCAPE:
+
+                    PostQuitMessage(0);
+                    break;
+
+            }
+            break;
+
+        case WM_CLOSE:
+            PostQuitMessage(0);
+            break;
+
+        case WM_DESTROY:
+            PostQuitMessage(0);
+            break;
+
+        default:
+            return DefWindowProc(hWnd, message, wParam, lParam);
+    }
+    return 0;
+}
+
+void EnableOpenGL(HWND hWnd, HDC* hDC, HGLRC* hRC) {
+    PIXELFORMATDESCRIPTOR pfd;
+    int iFormat;
+
+    *hDC = GetDC(hWnd);
+
+    ZeroMemory(&pfd, sizeof(pfd));
+    pfd.nSize = sizeof(pfd);
+    pfd.nVersion = 1;
+    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+    pfd.iPixelType = PFD_TYPE_RGBA;
+    pfd.cColorBits = 24;
+    pfd.cDepthBits = 16;
+    pfd.iLayerType = PFD_MAIN_PLANE;
+
+    iFormat = ChoosePixelFormat(*hDC, &pfd);
+    SetPixelFormat(*hDC, iFormat, &pfd);
+
+    *hRC = wglCreateContext(*hDC);
+    wglMakeCurrent(*hDC, *hRC);
+
+    wglSwapIntervalEXT = (PFNWGLSWAPINTERVALEXTPROC)wglGetProcAddress("wglSwapIntervalEXT");
+
+    if (wglSwapIntervalEXT) {
+
+        if (DEBUG_MODE) {
+            wglSwapIntervalEXT(0); 
+            std::cout << "V-Sync disabled (DEBUG_MODE is true)." << std::endl;
+        } else {
+            wglSwapIntervalEXT(1); 
+            std::cout << "V-Sync enabled (DEBUG_MODE is false)." << std::endl;
+        }
+    } else {
+        if (DEBUG_MODE) { 
+            std::cout << "Could not control V-Sync (wglSwapIntervalEXT not found or not supported)." << std::endl;
+        }
+    }
+}
+
+void DisableOpenGL(HWND hWnd, HDC hDC, HGLRC hRC) {
+    wglMakeCurrent(NULL, NULL);
+    wglDeleteContext(hRC);
+    ReleaseDC(hWnd, hDC);
+}
+
+void initOpenGL() {
+
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    if (DEBUG_MODE) { 
+        std::cout << "Sky color set to black at initialization." << std::endl;
+    }
+
+    glEnable(GL_DEPTH_TEST);
+    glDepthFunc(GL_LEQUAL);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+
+    GLfloat light_position[] = {1.0f, 1.0f, 1.0f, 0.0f};
+    GLfloat light_ambient[] = {0.2f, 0.2f, 0.2f, 1.0f};
+    GLfloat light_diffuse[] = {0.8f, 0.8f, 0.8f, 1.0f};
+    GLfloat light_specular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+
+    glLightfv(GL_LIGHT0, GL_POSITION, light_position);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, light_ambient);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
+    glLightfv(GL_LIGHT0, GL_SPECULAR, light_specular);
+
+    glEnable(GL_COLOR_MATERIAL);
+    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+    glShadeModel(GL_SMOOTH);
+
+    quadric = gluNewQuadric();
+    gluQuadricNormals(quadric, GLU_SMOOTH);
+
+    RECT rect;
+    GetClientRect(g_hWnd, &rect);
+    reshape(rect.right - rect.left, rect.bottom - rect.top);
+
+    resetCubes(); 
+}
+
+// Bulk layer assignment for bodies [first, last). Layers only take effect
+// when COLLISION_LAYERS is on.
+template <typename W>
+void setCollisionLayers(W& world, int first, int last, unsigned layer, unsigned mask) {
+    std::fill(world.layer.begin() + first, world.layer.begin() + last, layer);
+    std::fill(world.mask.begin() + first, world.mask.begin() + last, mask);
+}
+
+template <typename W>
+void setCollisionLayers(W& world, const int* bodies, int count, unsigned layer, unsigned mask) {
+    for (int k = 0; k < count; ++k) {
+        world.layer[bodies[k]] = layer;
+        world.mask[bodies[k]] = mask;
+    }
+}
+
+// Draws from random with its own copies of the distributions, so a scene
+// can be generated off the main thread.
+template <typename W>
+void resetWorld(W& world, std::mt19937& random) {
+    std::uniform_real_distribution<float> logSize = dist_log_size;
+    std::uniform_real_distribution<float> height = dist_height;
+    world.resize(NUM_CUBES);
+
+    for (int i = 0; i < world.count(); ++i) {
+        // Log-uniform, so a 100x spread gives as many small cubes as large.
+        world.size[i] = MIN_CUBE_SIZE < MAX_CUBE_SIZE ? std::exp(logSize(random)) : CUBE_SIZE;
+        world.shape[i] = SHAPE_BOX;
+        if (MIXED_SHAPES) {
+            float spheres = world.count() * SPHERE_FRACTION, capsules = spheres + world.count() * CAPSULE_FRACTION;
+            world.shape[i] = i < spheres ? SHAPE_SPHERE : i < capsules ? SHAPE_CAPSULE : SHAPE_BOX;
+        }
+        world.setMassFromSize(i);
+        world.setVelocity(i, Vec3(0.0f, 0.0f, 0.0f));
+        world.resetRotation(i);
+        world.resting[i] = false;
+        world.restTime[i] = 0.0f;
+        world.pendingDt[i] = 0.0f;
+        world.rateLevel[i] = 0;
+        world.deferredSteps[i] = 0;
+        world.layer[i] = LAYER_GAMEPLAY;
+        world.mask[i] = MASK_ALL;
+
+        Vec3 slot = world.spawnPosition(i);
+        world.setPosition(i, Vec3(slot.x, slot.y + height(random), slot.z));
+    }
+
+    // The last bodies become debris that only hits the ground and walls.
+    int debris = (int)(world.count() * DEBRIS_FRACTION);
+    setCollisionLayers(world, world.count() - debris, world.count(), LAYER_DEBRIS, 0u);
+}
+
+// Drops a fresh scene for up to SCENE_WARMUP_SECONDS in closed form. Every
+// body falls in its own spawn column, so nothing touches until the lowest
+// one reaches the ground, and the warm-up stops there. Attraction fields
+// are left out.
+template <typename W>
+void warmUpScene(W& world) {
+    float warmup = SCENE_WARMUP_SECONDS;
+    for (int i = 0; i < world.count(); ++i) {
+        float drop = std::max(world.py[i] - world.size[i] / 2.0f - GROUND_Y, 0.0f);
+        warmup = std::min(warmup, std::sqrt(2.0f * drop / GRAVITY));
+    }
+    if (warmup <= 0.0f) return;
+    for (int i = 0; i < world.count(); ++i) {
+        world.py[i] -= 0.5f * GRAVITY * warmup * warmup;
+        world.vy[i] = -GRAVITY * warmup;
+    }
+}
+
+// Generates the next scene on a background thread while the current one
+// runs, so a reset only has to swap it in. The heap world swaps its column
+// buffers in O(1) and the old scene's buffers are reused for the one after;
+// the fixed world is at most FIXED_WORLD_MAX_CUBES bodies, so its swap is a
+// small copy. The broadphases rebuild from positions every step and carry
+// nothing between scenes.
+struct ScenePreparer {
+    HANDLE thread = NULL;
+    HANDLE wake = NULL;
+    HANDLE ready = NULL;
+    std::atomic<bool> stopping{false};
+    // Main thread only: set by request(), cleared by take().
+    bool pending = false;
+
+    // Owned by the thread from request() until take().
+    SceneWorld scene;
+    std::mt19937 random;
+
+    static DWORD WINAPI prepareThread(LPVOID param) {
+        ScenePreparer* preparer = (ScenePreparer*)param;
+        for (;;) {
+            WaitForSingleObject(preparer->wake, INFINITE);
+            if (preparer->stopping) return 0;
+            resetWorld(preparer->scene, preparer->random);
+            warmUpScene(preparer->scene);
+            SetEvent(preparer->ready);
+        }
+    }
+
+    void start() {
+        wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+        thread = CreateThread(NULL, 0, prepareThread, this, 0, NULL);
+    }
+
+    // Seeded from the main rng, so scenes still follow its sequence.
+    void request() {
+        if (!thread) start();
+        random.seed(rng());
+        pending = true;
+        SetEvent(wake);
+    }
+
+    // Waits only if the scene is not finished yet, which takes a reset
+    // sooner than one reset interval after the last.
+    void take(SceneWorld& world) {
+        WaitForSingleObject(ready, INFINITE);
+        pending = false;
+        std::swap(world, scene);
+    }
+
+    void shutdown() {
+        if (!thread) return;
+        stopping = true;
+        SetEvent(wake);
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+        CloseHandle(wake);
+        CloseHandle(ready);
+        thread = NULL;
+    }
+};
+
+ScenePreparer scenePreparer;
+
+void shutdownScenePreparer() {
+    scenePreparer.shutdown();
+}
+
+void resetCubes() {
+    // The lockstep world makes its own scenes.
+    if constexpr (PREPARE_NEXT_SCENE && !FIXED_POINT_MODE) {
+        if (scenePreparer.pending) {
+            scenePreparer.take(world);
+        } else {
+            resetWorld(world, rng);
+            warmUpScene(world);
+        }
+        scenePreparer.request();
+    } else {
+        resetWorld(world, rng);
+    }
+
+    secondTimer = 0.0f;
+    secondsCount = 0;
+    fpsTimer = 0.0f;
+    frameCount = 0;
+    resetTimer = 0.0f;
+    simulationTime = 0.0f;
+    settleTime = -1.0f;
+    worldOriginX = 0.0;
+    worldOriginZ = 0.0;
+    stepsSinceRegionSort = 0;
+    stepsSinceConsolidation = 0;
+    stepIndex = 0;
+    clearRegionPaging();
+    clearCompounds();
+    restartBroadphaseTuner();
+    resetGranular();
+    resetFluid();
+    resetLockstep();
+    resetContactEvents();
+}
+
+template <typename W>
+void attractionAccelerations(W& world, float* ax, float* ay, float* az);
+
+// Accelerations besides gravity that depend on where the bodies are. The
+// integrators evaluate the policy's field as often as their scheme needs.
+struct NoField {
+    static constexpr bool active = false;
+    template <typename W>
+    static void accelerations(W&, float*, float*, float*) {}
+};
+
+struct AttractionField {
+    static constexpr bool active = true;
+    template <typename W>
+    static void accelerations(W& world, float* ax, float* ay, float* az) {
+        attractionAccelerations(world, ax, ay, az);
+    }
+};
+
+// Field accelerations at the current positions, zero where there are none.
+template <typename Field, typename W>
+void evaluateField(W& world, std::vector<float>& ax, std::vector<float>& ay, std::vector<float>& az) {
+    for (auto* column : {&ax, &ay, &az}) column->assign(world.count(), 0.0f);
+    Field::accelerations(world, ax.data(), ay.data(), az.data());
+}
+
+// Integrators take the step length per body through stepOf(i), so one body
+// of code serves both the uniform and the multi-rate overloads.
+template <typename Field>
+struct SemiImplicitEuler {
+    template <typename W>
+    static void integrate(W& world, float deltaTime) {
+        kickField(world, [deltaTime](int) { return deltaTime; });
+        simd.integrate(world.pointers(), world.count(), deltaTime);
+    }
+
+    // One step length per body, for multi-rate stepping.
+    template <typename W>
+    static void integrate(W& world, const float* deltaTimes) {
+        kickField(world, [deltaTimes](int i) { return deltaTimes[i]; });
+        simd.integrateVarying(world.pointers(), world.count(), deltaTimes);
+    }
+
+    template <typename W, typename StepOf>
+    static void kickField(W& world, StepOf stepOf) {
+        if constexpr (Field::active) {
+            static std::vector<float> ax, ay, az;
+            evaluateField<Field>(world, ax, ay, az);
+            for (int i = 0; i < world.count(); ++i) {
+                float dt = stepOf(i);
+                world.vx[i] += ax[i] * dt;
+                world.vy[i] += ay[i] * dt;
+                world.vz[i] += az[i] * dt;
+            }
+        }
+    }
+};
+
+// Drift-kick-drift leapfrog (position Verlet): half the step's motion, the
+// whole velocity change from the forces at the midpoint, then the other half.
+// Symplectic and second order like velocity Verlet, but it needs no forces
+// carried over from the last step, which would go stale whenever bodies are
+// reordered or removed. Ballistic flight comes out exact, so long free-fall
+// steps lose nothing, and the field is evaluated only once per step.
+template <typename Field>
+struct LeapfrogDKD {
+    template <typename W>
+    static void integrate(W& world, float deltaTime) {
+        step(world, [deltaTime](int) { return deltaTime; });
+    }
+
+    template <typename W>
+    static void integrate(W& world, const float* deltaTimes) {
+        step(world, [deltaTimes](int i) { return deltaTimes[i]; });
+    }
+
+    template <typename W, typename StepOf>
+    static void step(W& world, StepOf stepOf) {
+        int count = world.count();
+        if constexpr (!Field::active) {
+            for (int i = 0; i < count; ++i) {
+                float dt = stepOf(i);
+                world.px[i] += world.vx[i] * dt;
+                world.py[i] += (world.vy[i] - 0.5f * GRAVITY * dt) * dt;
+                world.pz[i] += world.vz[i] * dt;
+                world.vy[i] -= GRAVITY * dt;
+            }
+        } else {
+            static std::vector<float> ax, ay, az;
+            for (int i = 0; i < count; ++i) {
+                float half = 0.5f * stepOf(i);
+                world.px[i] += world.vx[i] * half;
+                world.py[i] += world.vy[i] * half;
+                world.pz[i] += world.vz[i] * half;
+            }
+            evaluateField<Field>(world, ax, ay, az);
+            for (int i = 0; i < count; ++i) {
+                float dt = stepOf(i), half = 0.5f * dt;
+                world.vx[i] += ax[i] * dt;
+                world.vy[i] += (ay[i] - GRAVITY) * dt;
+                world.vz[i] += az[i] * dt;
+                world.px[i] += world.vx[i] * half;
+                world.py[i] += world.vy[i] * half;
+                world.pz[i] += world.vz[i] * half;
+            }
+        }
+    }
+};
+
+// Classical fourth-order Runge-Kutta, the reference the cheaper schemes are
+// measured against: four field evaluations per step, each at the stage's
+// trial positions, which are written into the world while it is evaluated.
+// Under gravity alone every stage agrees and it is the exact ballistic step.
+template <typename Field>
+struct RungeKutta4 {
+    template <typename W>
+    static void integrate(W& world, float deltaTime) {
+        step(world, [deltaTime](int) { return deltaTime; });
+    }
+
+    template <typename W>
+    static void integrate(W& world, const float* deltaTimes) {
+        step(world, [deltaTimes](int i) { return deltaTimes[i]; });
+    }
+
+    template <typename W, typename StepOf>
+    static void step(W& world, StepOf stepOf) {
+        if constexpr (!Field::active) {
+            LeapfrogDKD<NoField>::step(world, stepOf);
+        } else {
+            static std::vector<float> x0, y0, z0, vx0, vy0, vz0;
+            static std::vector<float> motionX, motionY, motionZ, changeX, changeY, changeZ;
+            static std::vector<float> ax, ay, az;
+            int count = world.count();
+            x0.assign(world.px.begin(), world.px.begin() + count);
+            y0.assign(world.py.begin(), world.py.begin() + count);
+            z0.assign(world.pz.begin(), world.pz.begin() + count);
+            vx0.assign(world.vx.begin(), world.vx.begin() + count);
+            vy0.assign(world.vy.begin(), world.vy.begin() + count);
+            vz0.assign(world.vz.begin(), world.vz.begin() + count);
+            for (auto* column : {&motionX, &motionY, &motionZ, &changeX, &changeY, &changeZ}) column->assign(count, 0.0f);
+
+            // Stage s sees the world at its trial state; its slopes are the
+            // world's velocity and the field there, and they set up the
+            // trial state of stage s + 1.
+            const float weight[4] = {1.0f, 2.0f, 2.0f, 1.0f};
+            const float advance[3] = {0.5f, 0.5f, 1.0f};
+            for (int stage = 0; stage < 4; ++stage) {
+                evaluateField<Field>(world, ax, ay, az);
+                for (int i = 0; i < count; ++i) {
+                    float vx = world.vx[i], vy = world.vy[i], vz = world.vz[i];
+                    float gx = ax[i], gy = ay[i] - GRAVITY, gz = az[i];
+                    motionX[i] += weight[stage] * vx; motionY[i] += weight[stage] * vy; motionZ[i] += weight[stage] * vz;
+                    changeX[i] += weight[stage] * gx; changeY[i] += weight[stage] * gy; changeZ[i] += weight[stage] * gz;
+                    if (stage < 3) {
+                        float h = advance[stage] * stepOf(i);
+                        world.px[i] = x0[i] + vx * h; world.py[i] = y0[i] + vy * h; world.pz[i] = z0[i] + vz * h;
+                        world.vx[i] = vx0[i] + gx * h; world.vy[i] = vy0[i] + gy * h; world.vz[i] = vz0[i] + gz * h;
+                    }
+                }
+            }
+            for (int i = 0; i < count; ++i) {
+                float sixth = stepOf(i) / 6.0f;
+                world.px[i] = x0[i] + motionX[i] * sixth; world.py[i] = y0[i] + motionY[i] * sixth; world.pz[i] = z0[i] + motionZ[i] * sixth;
+                world.vx[i] = vx0[i] + changeX[i] * sixth; world.vy[i] = vy0[i] + changeY[i] * sixth; world.vz[i] = vz0[i] + changeZ[i] * sixth;
+            }
+        }
+    }
+};
+
+struct ArenaWalls {
+    static constexpr bool ground = true;
+    static constexpr bool sides = true;
+    static constexpr float bound = 8.0f;
+};
+
+struct GroundOnly {
+    static constexpr bool ground = true;
+    static constexpr bool sides = false;
+    static constexpr float bound = 8.0f;
+};
+
+// Fraction of a contact's sliding speed that one impact removes.
+struct ScaledFriction {
+    static float slipReduction(float) { return 1.0f - FRICTION_FACTOR; }
+};
+
+// Slow sliding stops outright, so bodies come to rest where they land.
+struct StickingFriction {
+    static float slipReduction(float slip_speed) { return slip_speed < STICK_SPEED ? 1.0f : 1.0f - FRICTION_FACTOR; }
+};
+
+struct NoFriction {
+    static float slipReduction(float) { return 0.0f; }
+};
+
+// Coefficient of restitution for an impact at the given approach speed.
+struct ConstantRestitution {
+    static float at(float) { return BOUNCE_FACTOR; }
+};
+
+// Slow impacts do not bounce at all, which turns ground contact into a
+// resting contact instead of a stream of ever smaller hops.
+struct ThresholdRestitution {
+    static float at(float speed) { return speed < RESTITUTION_MIN_SPEED ? 0.0f : SETTLE_BOUNCE_FACTOR; }
+};
+
+// Contact solvers. Impulse resolves each contact in turn as it is found;
+// position-based projects all contacts together with Jacobi iterations
+// (solvePositions).
+struct ImpulseSolver {};
+struct PositionBasedSolver {};
+
+// Broadphase tags. Tiled tests every pair with the SIMD overlap kernel;
+// the hierarchical grid keeps cost near-linear when sizes vary widely.
+// Adaptive costs the strategies against each other as the scene runs.
+struct TiledBroadphase {};
+struct HierarchicalGridBroadphase {};
+struct AdaptiveBroadphase {};
+
+// Every branch on these members is resolved at compile time; derive from
+// DefaultStepPolicy and override members to build other configurations.
+struct DefaultStepPolicy {
+    using Field = std::conditional<MUTUAL_ATTRACTION, AttractionField, NoField>::type;
+    using Integrator = std::conditional<RK4_INTEGRATOR, RungeKutta4<Field>,
+        std::conditional<LEAPFROG_INTEGRATOR, LeapfrogDKD<Field>, SemiImplicitEuler<Field>>::type>::type;
+    using Walls = ArenaWalls;
+    using Friction = std::conditional<SETTLE_SCENES, StickingFriction, ScaledFriction>::type;
+    using Restitution = std::conditional<SETTLE_SCENES, ThresholdRestitution, ConstantRestitution>::type;
+    using Solver = std::conditional<POSITION_BASED_SOLVER, PositionBasedSolver, ImpulseSolver>::type;
+    using Broadphase = std::conditional<ADAPTIVE_BROADPHASE, AdaptiveBroadphase,
+        std::conditional<(MIN_CUBE_SIZE < MAX_CUBE_SIZE), HierarchicalGridBroadphase, TiledBroadphase>::type>::type;
+    static constexpr bool randomize = true;
+    static constexpr bool instrument = DEBUG_MODE;
+    static constexpr bool regionLayout = false;
+    static constexpr bool rebaseOrigin = false;
+    static constexpr bool pageRegions = false;
+    static constexpr bool consolidatePiles = CONSOLIDATE_PILES;
+    static constexpr bool multiRate = MULTI_RATE_STEPPING;
+    static constexpr bool timeBudget = TIME_BUDGETED_STEP;
+    static constexpr bool collisionLayers = COLLISION_LAYERS;
+    static constexpr bool mixedShapes = MIXED_SHAPES;
+    static constexpr bool granular = GRANULAR_MODE;
+    static constexpr bool fluid = FLUID_MODE;
+    static constexpr bool settle = SETTLE_SCENES;
+    static constexpr bool contactEvents = CONTACT_EVENTS;
+};
+
+// No side walls: bodies may spread over any distance on the ground plane.
+struct UnboundedStepPolicy : DefaultStepPolicy {
+    using Walls = GroundOnly;
+    using Broadphase = HierarchicalGridBroadphase;
+    static constexpr bool regionLayout = true;
+    static constexpr bool rebaseOrigin = true;
+    static constexpr bool pageRegions = PAGE_SLEEPING_REGIONS;
+};
+
+struct StepStats {
+    int pairTests;
+    int contacts;
+    int wallHits;
+    int deferred;
+};
+
+StepStats stepStats = {0, 0, 0, 0};
+
+enum ContactPhase : unsigned char {
+    CONTACT_BEGIN,
+    CONTACT_PERSIST,
+    CONTACT_END
+};
+
+// One contact in the published stream. For the ground and the walls body2
+// is -1 and surface is their WALL_* flag; for a consolidated pile body2 is
+// the compound's index and surface is CONTACT_COMPOUND, one contact however
+// many of its members the body touches. Body pairs have surface 0.
+// impulse is the normal impulse the contact applied this step; end events
+// carry 0 and the last point the contact was seen at.
+struct ContactEvent {
+    int body1;
+    int body2;
+    unsigned char surface;
+    unsigned char phase;
+    float impulse;
+    Vec3 point;
+};
+
+// Contacts are recorded by the response code into the calling thread's own
+// buffer, which it claims on its first report, so the parallel solver
+// passes append without locks.
+// publish() runs once per step on the main thread: it merges the buffers,
+// matches them against the contacts alive at the last step and replaces
+// events with the result, sorted by body and then partner. A contact ends
+// only after CONTACT_END_STEPS steps without a report, since bodies resting
+// on something touch it only every other step. Bodies are identified by
+// index, so a region sort or consolidation shows up as ends and begins.
+struct ContactStream {
+    struct Record {
+        uint64_t key;
+        float impulse;
+        Vec3 point;
+    };
+
+    struct Tracked {
+        uint64_t key;
+        unsigned long long lastSeen;
+        Vec3 point;
+    };
+
+    static constexpr int SLOTS = MAX_WORKER_THREADS + 1;
+
+    std::vector<Record> buffers[SLOTS];
+    std::atomic<int> slotsUsed{0};
+    std::vector<Record> merged;
+    std::vector<Tracked> active, survivors;
+    std::vector<ContactEvent> events;
+
+    // Pairs are keyed by the lower index first; surfaces sort after bodies.
+    static uint64_t key(int body1, int body2, unsigned char surface) {
+        if (surface != 0) return ((uint64_t)(uint32_t)body1 << 32) | 0x80000000u | ((uint32_t)std::max(body2, 0) << 8) | surface;
+        if (body2 < body1) std::swap(body1, body2);
+        return ((uint64_t)(uint32_t)body1 << 32) | (uint32_t)body2;
+    }
+
+    void record(int body1, int body2, unsigned char surface, float impulse, const Vec3& point) {
+        thread_local int slot = -1;
+        if (slot < 0) slot = slotsUsed.fetch_add(1);
+        buffers[slot].push_back({key(body1, body2, surface), impulse, point});
+    }
+
+    void emit(uint64_t k, ContactPhase phase, float impulse, const Vec3& point) {
+        unsigned low = (unsigned)k;
+        bool surface = (low & 0x80000000u) != 0;
+        unsigned char kind = surface ? (unsigned char)(low & 0xffu) : 0;
+        int body2 = !surface ? (int)low : kind == CONTACT_COMPOUND ? (int)((low >> 8) & 0x7fffffu) : -1;
+        events.push_back({(int)(k >> 32), body2, kind,
+                          (unsigned char)phase, impulse, point});
+    }
+
+    // A body running at a slower rate did not look for contacts this step,
+    // so contacts it is part of are held rather than aged.
+    template <typename Policy, typename W>
+    bool held(const W& world, uint64_t k) const {
+        if constexpr (Policy::multiRate) {
+            int body1 = (int)(k >> 32);
+            unsigned low = (unsigned)k;
+            if (body1 >= world.count() || world.due[body1]) return false;
+            return (low & 0x80000000u) || ((int)low < world.count() && !world.due[low]);
+        } else {
+            return false;
+        }
+    }
+
+    // Repeat reports of one contact within the step add up; the point is
+    // taken from the strongest.
+    template <typename Policy, typename W>
+    void publish(const W& world, unsigned long long step) {
+        merged.clear();
+        int used = std::min(slotsUsed.load(), SLOTS);
+        for (int t = 0; t < used; ++t) {
+            merged.insert(merged.end(), buffers[t].begin(), buffers[t].end());
+            buffers[t].clear();
+        }
+        std::sort(merged.begin(), merged.end(), [](const Record& a, const Record& b) {
+            return a.key < b.key || (a.key == b.key && a.impulse > b.impulse);
+        });
+        size_t unique = 0;
+        for (size_t r = 0; r < merged.size(); ++r) {
+            if (unique > 0 && merged[unique - 1].key == merged[r].key) {
+                merged[unique - 1].impulse += merged[r].impulse;
+            } else {
+                merged[unique++] = merged[r];
+            }
+        }
+        merged.resize(unique);
+
+        events.clear();
+        survivors.clear();
+        size_t a = 0, m = 0;
+        while (a < active.size() || m < merged.size()) {
+            if (m == merged.size() || (a < active.size() && active[a].key < merged[m].key)) {
+                const Tracked& gone = active[a++];
+                if (step - gone.lastSeen < (unsigned long long)CONTACT_END_STEPS || held<Policy>(world, gone.key)) {
+                    survivors.push_back(gone);
+                } else {
+                    emit(gone.key, CONTACT_END, 0.0f, gone.point);
+                }
+                continue;
+            }
+            bool known = a < active.size() && active[a].key == merged[m].key;
+            if (known) a++;
+            emit(merged[m].key, known ? CONTACT_PERSIST : CONTACT_BEGIN, merged[m].impulse, merged[m].point);
+            survivors.push_back({merged[m].key, step, merged[m].point});
+            m++;
+        }
+        std::swap(active, survivors);
+    }
+
+    // A new scene starts with no contacts; nothing ends for the old one.
+    void reset() {
+        int used = std::min(slotsUsed.load(), SLOTS);
+        for (int t = 0; t < used; ++t) buffers[t].clear();
+        active.clear();
+        events.clear();
+    }
+};
+
+ContactStream contactStream;
+
+void resetContactEvents() {
+    contactStream.reset();
+}
+
+// Sliding friction at contact offsets r1/r2 (r2 unused when body2 < 0),
+// applied as an impulse so it spins the bodies as well as slowing them.
+template <typename Policy, typename W>
+void applyFriction(W& world, int body1, int body2, const Vec3& r1, const Vec3& r2, const Vec3& normal,
+                   Vec3& velocity1, Vec3& spin1, Vec3& velocity2, Vec3& spin2) {
+    Vec3 relative = velocity1 + spin1.cross(r1);
+    if (body2 >= 0) relative = relative - (velocity2 + spin2.cross(r2));
+
+    Vec3 slip = relative - normal * relative.dot(normal);
+    float slip_speed = slip.length();
+    if (slip_speed <= 0.0f) return;
+
+    Vec3 tangent = slip * (1.0f / slip_speed);
+    Vec3 rt1 = r1.cross(tangent);
+    float denominator = world.invMass[body1] + world.invInertia[body1] * rt1.dot(rt1);
+    if (body2 >= 0) {
+        Vec3 rt2 = r2.cross(tangent);
+        denominator += world.invMass[body2] + world.invInertia[body2] * rt2.dot(rt2);
+    }
+
+    Vec3 impulse = tangent * (-Policy::Friction::slipReduction(slip_speed) * slip_speed / denominator);
+    velocity1 = velocity1 + impulse * world.invMass[body1];
+    spin1 = spin1 + r1.cross(impulse) * world.invInertia[body1];
+    if (body2 >= 0) {
+        velocity2 = velocity2 - impulse * world.invMass[body2];
+        spin2 = spin2 - r2.cross(impulse) * world.invInertia[body2];
+    }
+}
+
+// Direction a body rebounds from a static plane in.
+template <typename Policy>
+Vec3 bounceDirection(const Vec3& normal) {
+    Vec3 bounce_direction = normal;
+    if constexpr (Policy::randomize) {
+        Vec3 random_perturb = Vec3(normal.x != 0.0f ? 0.0f : dist_bounce_angle(rng),
+                                   normal.y != 0.0f ? 0.0f : dist_bounce_angle(rng),
+                                   normal.z != 0.0f ? 0.0f : dist_bounce_angle(rng));
+        bounce_direction = (normal + random_perturb).normalize();
+    }
+    return bounce_direction;
+}
+
+// Contact with a static plane through the face centre of cube i. Returns
+// the normal impulse applied, 0 when the body was not approaching.
+template <typename Policy, typename W>
+float bounceOffPlane(W& world, int i, const Vec3& normal) {
+    Vec3 bounce_direction = bounceDirection<Policy>(normal);
+    float impulse = 0.0f;
+
+    Vec3 r = normal * -(world.size[i] / 2.0f);
+    Vec3 velocity = world.velocity(i);
+    Vec3 spin = world.angularVelocity(i);
+
+    float normal_speed = (velocity + spin.cross(r)).dot(normal);
+    if (normal_speed < 0.0f) {
+        // A body that was resting stays in resting contact with the ground,
+        // however much speed a long multi-rate step gave it.
+        float restitution = Policy::Restitution::at(-normal_speed);
+        if constexpr (Policy::settle) {
+            if (world.resting[i] && normal.y > 0.0f) restitution = 0.0f;
+        }
+        Vec3 rn = r.cross(normal);
+        impulse = -(1.0f + restitution) * normal_speed / (world.invMass[i] + world.invInertia[i] * rn.dot(rn));
+        velocity = velocity + normal * (impulse * world.invMass[i]);
+        spin = spin + rn * (impulse * world.invInertia[i]);
+
+        // The random perturbation only tilts the rebound; it keeps the
+        // rebound speed so the scatter cannot add energy.
+        float rebound_speed = velocity.dot(normal);
+        velocity = velocity - normal * rebound_speed + bounce_direction * rebound_speed;
+    }
+
+    Vec3 unused;
+    applyFriction<Policy>(world, i, -1, r, unused, normal, velocity, spin, unused, unused);
+
+    world.setVelocity(i, velocity);
+    world.setSpin(i, spin, simulationTime);
+
+    return impulse;
+}
+
+// bounceOffPlane against the ground or a wall, reported as a contact.
+template <typename Policy, typename W>
+void bounceOffWall(W& world, int i, const Vec3& normal, unsigned char surface) {
+    float impulse = bounceOffPlane<Policy>(world, i, normal);
+    if constexpr (Policy::instrument) {
+        stepStats.wallHits++;
+    }
+    if constexpr (Policy::contactEvents) {
+        contactStream.record(i, -1, surface, impulse, world.position(i) - normal * (world.size[i] / 2.0f));
+    }
+}
+
+// A slow body on the ground comes to rest; anything else is awake.
+template <typename W>
+void updateResting(W& world, int i, float cube_bottom, float deltaTime) {
+    if (world.velocity(i).length() < REST_THRESHOLD && world.angularVelocity(i).length() < REST_THRESHOLD * 10 && (cube_bottom <= GROUND_Y + REST_THRESHOLD)) {
+        world.resting[i] = true;
+        world.restTime[i] += deltaTime;
+        world.setVelocity(i, Vec3(0.0f, 0.0f, 0.0f));
+        world.setSpin(i, Vec3(0.0f, 0.0f, 0.0f), simulationTime);
+    } else {
+        world.resting[i] = false;
+        world.restTime[i] = 0.0f;
+    }
+}
+
+// Linear drag on every body. Spin only decays while a body touches the
+// ground, a wall or another body, so free flight keeps its closed-form
+// rotation.
+template <typename Policy, typename W>
+void dampBodies(W& world, float deltaTime) {
+    for (int i = 0; i < world.count(); ++i) {
+        float dt = deltaTime;
+        if constexpr (Policy::multiRate) {
+            if (!world.due[i]) continue;
+            dt = world.stepDt[i];
+        }
+        world.setVelocity(i, world.velocity(i) * (1.0f / (1.0f + LINEAR_DAMPING * dt)));
+        if (world.wallFlags[i] != 0) {
+            world.setSpin(i, world.angularVelocity(i) * (1.0f / (1.0f + CONTACT_ANGULAR_DAMPING * dt)), simulationTime);
+        }
+    }
+}
+
+// Records settleTime the first step every body is at rest. Bodies stacked
+// on others never count as resting, so for them being that slow is enough.
+template <typename Policy, typename W>
+void trackSettling(W& world) {
+    if (settleTime >= 0.0f) return;
+    for (int i = 0; i < world.count(); ++i) {
+        if (!world.resting[i] && (world.velocity(i).length() >= REST_THRESHOLD || world.angularVelocity(i).length() >= REST_THRESHOLD * 10)) return;
+    }
+    settleTime = simulationTime;
+    if constexpr (Policy::instrument) {
+        std::cout << "Scene settled after " << settleTime << " s" << std::endl;
+    }
+}
+
+template <typename Policy, typename W>
+void collideWalls(W& world, float deltaTime) {
+    using Walls = typename Policy::Walls;
+
+    unsigned char enabled = 0;
+    if constexpr (Walls::ground) enabled |= WALL_GROUND;
+    if constexpr (Walls::sides) enabled |= WALL_MIN_X | WALL_MAX_X | WALL_MIN_Z | WALL_MAX_Z;
+
+    simd.wallFlags(world.pointers(), world.count(), GROUND_Y, Walls::bound, world.wallFlags.data());
+
+    for (int i = 0; i < world.count(); ++i) {
+        // A body that did not move this step was already resolved.
+        if constexpr (Policy::multiRate) {
+            if (!world.due[i]) continue;
+        }
+
+        float halfSize = world.size[i] / 2.0f;
+        float cube_bottom = world.py[i] - halfSize;
+        unsigned char flags = world.wallFlags[i] & enabled;
+
+        if (flags & WALL_GROUND) {
+            world.py[i] = GROUND_Y + halfSize;
+            bounceOffWall<Policy>(world, i, Vec3(0.0f, 1.0f, 0.0f), WALL_GROUND);
+        }
+
+        if (flags & WALL_MIN_X) {
+            world.px[i] = -Walls::bound + halfSize;
+            bounceOffWall<Policy>(world, i, Vec3(1.0f, 0.0f, 0.0f), WALL_MIN_X);
+        } else if (flags & WALL_MAX_X) {
+            world.px[i] = Walls::bound - halfSize;
+            bounceOffWall<Policy>(world, i, Vec3(-1.0f, 0.0f, 0.0f), WALL_MAX_X);
+        }
+
+        if (flags & WALL_MIN_Z) {
+            world.pz[i] = -Walls::bound + halfSize;
+            bounceOffWall<Policy>(world, i, Vec3(0.0f, 0.0f, 1.0f), WALL_MIN_Z);
+        } else if (flags & WALL_MAX_Z) {
+            world.pz[i] = Walls::bound - halfSize;
+            bounceOffWall<Policy>(world, i, Vec3(0.0f, 0.0f, -1.0f), WALL_MAX_Z);
+        }
+
+        updateResting(world, i, cube_bottom, deltaTime);
+    }
+}
+
+// A penetrating contact between bodies i and j. The normal points from j
+// towards i; the point is where the impulse acts.
+struct Contact {
+    Vec3 normal;
+    float depth;
+    Vec3 point;
+};
+
+// Separates the pair along the contact normal and, if they are approaching,
+// applies the restitution and friction impulses at the contact point.
+template <typename Policy, typename W>
+void applyContact(W& world, int i, int j, const Contact& contact) {
+    Vec3 position1 = world.position(i);
+    Vec3 position2 = world.position(j);
+    Vec3 r1 = contact.point - position1;
+    Vec3 r2 = contact.point - position2;
+
+    float separation_amount = contact.depth / 2.0f + 0.001f;
+    world.setPosition(i, position1 + contact.normal * separation_amount);
+    world.setPosition(j, position2 - contact.normal * separation_amount);
+
+    Vec3 velocity1 = world.velocity(i);
+    Vec3 velocity2 = world.velocity(j);
+    Vec3 spin1 = world.angularVelocity(i);
+    Vec3 spin2 = world.angularVelocity(j);
+    float relative_velocity_along_mtv = ((velocity1 + spin1.cross(r1)) - (velocity2 + spin2.cross(r2))).dot(contact.normal);
+    float impulse = 0.0f;
+
+    if (relative_velocity_along_mtv < 0) {
+        Vec3 rn1 = r1.cross(contact.normal);
+        Vec3 rn2 = r2.cross(contact.normal);
+        float denominator = world.invMass[i] + world.invMass[j]
+                          + world.invInertia[i] * rn1.dot(rn1) + world.invInertia[j] * rn2.dot(rn2);
+        impulse = -(1.0f + Policy::Restitution::at(-relative_velocity_along_mtv)) * relative_velocity_along_mtv / denominator;
+        Vec3 impulse_vector = contact.normal * impulse;
+
+        velocity1 = velocity1 + impulse_vector * world.invMass[i];
+        velocity2 = velocity2 - impulse_vector * world.invMass[j];
+        spin1 = spin1 + r1.cross(impulse_vector) * world.invInertia[i];
+        spin2 = spin2 - r2.cross(impulse_vector) * world.invInertia[j];
+
+        applyFriction<Policy>(world, i, j, r1, r2, contact.normal, velocity1, spin1, velocity2, spin2);
+
+        world.setVelocity(i, velocity1);
+        world.setVelocity(j, velocity2);
+        world.setSpin(i, spin1, simulationTime);
+        world.setSpin(j, spin2, simulationTime);
+        world.wallFlags[i] |= CONTACT_BODY;
+        world.wallFlags[j] |= CONTACT_BODY;
+
+        if constexpr (Policy::instrument) {
+            stepStats.contacts++;
+        }
+    }
+
+    if constexpr (Policy::contactEvents) {
+        contactStream.record(i, j, 0, impulse, contact.point);
+    }
+}
+
+// Minimum translation between two axis-aligned boxes; the overlap box's
+// centre is the contact point.
+inline Contact boxContact(const Vec3& position1, float h1, const Vec3& position2, float h2) {
+    float overlap_x = std::min(position1.x + h1, position2.x + h2) - std::max(position1.x - h1, position2.x - h2);
+    float overlap_y = std::min(position1.y + h1, position2.y + h2) - std::max(position1.y - h1, position2.y - h2);
+    float overlap_z = std::min(position1.z + h1, position2.z + h2) - std::max(position1.z - h1, position2.z - h2);
+
+    Contact contact;
+    if (overlap_x < overlap_y && overlap_x < overlap_z) {
+        contact.depth = overlap_x;
+        contact.normal = Vec3((position1.x > position2.x) ? 1.0f : -1.0f, 0.0f, 0.0f);
+    } else if (overlap_y < overlap_x && overlap_y < overlap_z) {
+        contact.depth = overlap_y;
+        contact.normal = Vec3(0.0f, (position1.y > position2.y) ? 1.0f : -1.0f, 0.0f);
+    } else {
+        contact.depth = overlap_z;
+        contact.normal = Vec3(0.0f, 0.0f, (position1.z > position2.z) ? 1.0f : -1.0f);
+    }
+
+    contact.point = Vec3((std::max(position1.x - h1, position2.x - h2) + std::min(position1.x + h1, position2.x + h2)) / 2.0f,
+                         (std::max(position1.y - h1, position2.y - h2) + std::min(position1.y + h1, position2.y + h2)) / 2.0f,
+                         (std::max(position1.z - h1, position2.z - h2) + std::min(position1.z + h1, position2.z + h2)) / 2.0f);
+    return contact;
+}
+
+template <typename Policy, typename W>
+void resolveCubePair(W& world, int i, int j) {
+    applyContact<Policy>(world, i, j, boxContact(world.position(i), world.size[i] / 2.0f, world.position(j), world.size[j] / 2.0f));
+}
+
+// Contact between spheres at c1 and c2, or false if they are apart.
+inline bool sphereContact(const Vec3& c1, float r1, const Vec3& c2, float r2, Contact& contact) {
+    Vec3 d = c1 - c2;
+    float distanceSquared = d.dot(d);
+    if (distanceSquared >= (r1 + r2) * (r1 + r2)) return false;
+    float distance = std::sqrt(distanceSquared);
+    contact.normal = distance > 0.0f ? d * (1.0f / distance) : Vec3(0.0f, 1.0f, 0.0f);
+    contact.depth = r1 + r2 - distance;
+    contact.point = c2 + contact.normal * (r2 - contact.depth / 2.0f);
+    return true;
+}
+
+// Sphere (c, r) against the box at p with half-extent h. A centre inside
+// the box falls back to the box test against the sphere's bounding cube.
+inline bool boxSphereContact(const Vec3& p, float h, const Vec3& c, float r, Contact& contact) {
+    Vec3 closest(std::min(std::max(c.x, p.x - h), p.x + h),
+                 std::min(std::max(c.y, p.y - h), p.y + h),
+                 std::min(std::max(c.z, p.z - h), p.z + h));
+    Vec3 d = closest - c;
+    float distanceSquared = d.dot(d);
+    if (distanceSquared >= r * r) return false;
+    if (distanceSquared == 0.0f) {
+        contact = boxContact(p, h, c, r);
+        return true;
+    }
+    float distance = std::sqrt(distanceSquared);
+    contact.normal = d * (1.0f / distance);
+    contact.depth = r - distance;
+    contact.point = closest;
+    return true;
+}
+
+inline Vec3 closestOnSegment(const Vec3& a, const Vec3& b, const Vec3& p) {
+    Vec3 ab = b - a;
+    float t = ab.dot(ab) > 0.0f ? std::min(std::max((p - a).dot(ab) / ab.dot(ab), 0.0f), 1.0f) : 0.0f;
+    return a + ab * t;
+}
+
+// Closest points between segments a0-a1 and b0-b1.
+inline void closestBetweenSegments(const Vec3& a0, const Vec3& a1, const Vec3& b0, const Vec3& b1, Vec3& onA, Vec3& onB) {
+    Vec3 da = a1 - a0, db = b1 - b0, r = a0 - b0;
+    float aa = da.dot(da), bb = db.dot(db), ab = da.dot(db), ar = da.dot(r), br = db.dot(r);
+    float denominator = aa * bb - ab * ab;
+    float s = denominator > 1e-8f ? std::min(std::max((ab * br - ar * bb) / denominator, 0.0f), 1.0f) : 0.0f;
+    float t = bb > 0.0f ? (ab * s + br) / bb : 0.0f;
+    if (t < 0.0f || t > 1.0f) {
+        t = std::min(std::max(t, 0.0f), 1.0f);
+        s = aa > 0.0f ? std::min(std::max((ab * t - ar) / aa, 0.0f), 1.0f) : 0.0f;
+    }
+    onA = a0 + da * s;
+    onB = b0 + db * t;
+}
+
+template <typename W>
+void capsuleSegment(const W& world, int i, Vec3& a, Vec3& b) {
+    Quat q = world.orientationAt(i, simulationTime);
+    Vec3 axis(2.0f * (q.x * q.y - q.w * q.z), 1.0f - 2.0f * (q.x * q.x + q.z * q.z), 2.0f * (q.y * q.z + q.w * q.x));
+    Vec3 offset = axis * (world.size[i] / 4.0f);
+    a = world.position(i) - offset;
+    b = world.position(i) + offset;
+}
+
+// Narrowphase kernels, one per shape combination with A <= B; the primary
+// template serves B < A by swapping the bodies and flipping the normal.
+template <int A, int B>
+struct ShapeContact {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        if (!ShapeContact<B, A>::test(world, j, i, contact)) return false;
+        contact.normal = contact.normal * -1.0f;
+        return true;
+    }
+};
+
+template <>
+struct ShapeContact<SHAPE_BOX, SHAPE_BOX> {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        contact = boxContact(world.position(i), world.size[i] / 2.0f, world.position(j), world.size[j] / 2.0f);
+        return true;
+    }
+};
+
+template <>
+struct ShapeContact<SHAPE_BOX, SHAPE_SPHERE> {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        return boxSphereContact(world.position(i), world.size[i] / 2.0f, world.position(j), world.size[j] / 2.0f, contact);
+    }
+};
+
+// Approximated by the capsule's sphere nearest the box centre.
+template <>
+struct ShapeContact<SHAPE_BOX, SHAPE_CAPSULE> {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        Vec3 a, b;
+        capsuleSegment(world, j, a, b);
+        return boxSphereContact(world.position(i), world.size[i] / 2.0f, closestOnSegment(a, b, world.position(i)), world.size[j] / 4.0f, contact);
+    }
+};
+
+template <>
+struct ShapeContact<SHAPE_SPHERE, SHAPE_SPHERE> {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        return sphereContact(world.position(i), world.size[i] / 2.0f, world.position(j), world.size[j] / 2.0f, contact);
+    }
+};
+
+template <>
+struct ShapeContact<SHAPE_SPHERE, SHAPE_CAPSULE> {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        Vec3 a, b;
+        capsuleSegment(world, j, a, b);
+        return sphereContact(world.position(i), world.size[i] / 2.0f, closestOnSegment(a, b, world.position(i)), world.size[j] / 4.0f, contact);
+    }
+};
+
+template <>
+struct ShapeContact<SHAPE_CAPSULE, SHAPE_CAPSULE> {
+    template <typename W>
+    static bool test(const W& world, int i, int j, Contact& contact) {
+        Vec3 a0, a1, b0, b1, onA, onB;
+        capsuleSegment(world, i, a0, a1);
+        capsuleSegment(world, j, b0, b1);
+        closestBetweenSegments(a0, a1, b0, b1, onA, onB);
+        return sphereContact(onA, world.size[i] / 4.0f, onB, world.size[j] / 4.0f, contact);
+    }
+};
+
+template <typename Policy, typename W, int A, int B>
+void resolveShapePairOf(W& world, int i, int j) {
+    Contact contact;
+    if (ShapeContact<A, B>::test(world, i, j, contact)) {
+        applyContact<Policy>(world, i, j, contact);
+    }
+}
+
+// Double dispatch on the two bodies' shapes, for callers that resolve one
+// pair at a time; bulk callers bucket pairs first (resolveShapeBuckets).
+template <typename Policy, typename W>
+struct ShapePairTable {
+    using Resolve = void (*)(W& world, int i, int j);
+    static constexpr Resolve table[NUM_SHAPES][NUM_SHAPES] = {
+        {resolveShapePairOf<Policy, W, SHAPE_BOX, SHAPE_BOX>, resolveShapePairOf<Policy, W, SHAPE_BOX, SHAPE_SPHERE>, resolveShapePairOf<Policy, W, SHAPE_BOX, SHAPE_CAPSULE>},
+        {resolveShapePairOf<Policy, W, SHAPE_SPHERE, SHAPE_BOX>, resolveShapePairOf<Policy, W, SHAPE_SPHERE, SHAPE_SPHERE>, resolveShapePairOf<Policy, W, SHAPE_SPHERE, SHAPE_CAPSULE>},
+        {resolveShapePairOf<Policy, W, SHAPE_CAPSULE, SHAPE_BOX>, resolveShapePairOf<Policy, W, SHAPE_CAPSULE, SHAPE_SPHERE>, resolveShapePairOf<Policy, W, SHAPE_CAPSULE, SHAPE_CAPSULE>},
+    };
+};
+
+// The narrowphase tests alone, for solvers that apply contacts themselves.
+template <typename W>
+struct ShapeTestTable {
+    using Test = bool (*)(const W& world, int i, int j, Contact& contact);
+    static constexpr Test table[NUM_SHAPES][NUM_SHAPES] = {
+        {ShapeContact<SHAPE_BOX, SHAPE_BOX>::test<W>, ShapeContact<SHAPE_BOX, SHAPE_SPHERE>::test<W>, ShapeContact<SHAPE_BOX, SHAPE_CAPSULE>::test<W>},
+        {ShapeContact<SHAPE_SPHERE, SHAPE_BOX>::test<W>, ShapeContact<SHAPE_SPHERE, SHAPE_SPHERE>::test<W>, ShapeContact<SHAPE_SPHERE, SHAPE_CAPSULE>::test<W>},
+        {ShapeContact<SHAPE_CAPSULE, SHAPE_BOX>::test<W>, ShapeContact<SHAPE_CAPSULE, SHAPE_SPHERE>::test<W>, ShapeContact<SHAPE_CAPSULE, SHAPE_CAPSULE>::test<W>},
+    };
+};
+
+// Resolves one candidate pair whose bounds overlap.
+template <typename Policy, typename W>
+void resolveBodyPair(W& world, int i, int j) {
+    if constexpr (Policy::mixedShapes) {
+        ShapePairTable<Policy, W>::table[world.shape[i]][world.shape[j]](world, i, j);
+    } else {
+        resolveCubePair<Policy>(world, i, j);
+    }
+}
+
+// Tiles are aligned to PAIR_TILE so they never run past the padded capacity.
+// After a hit the rest of the tile is re-tested, because resolving the
+// contact moved cube i. Returns the number of contacts found.
+template <typename Policy, typename W>
+int collidePairsTiled(W& world) {
+    CubeColumnPointers columns = world.pointers();
+    int hits = 0;
+    for (int i = 0; i < world.count(); ++i) {
+        if constexpr (Policy::instrument) {
+            stepStats.pairTests += world.count() - i - 1;
+        }
+
+        int j = i + 1;
+        while (j < world.count()) {
+            int base = j - j % PAIR_TILE;
+            unsigned allowed = ~0u << (j - base);
+            if constexpr (Policy::collisionLayers) {
+                allowed &= layerTile(columns, i, base);
+                if (allowed == 0) {
+                    j = base + PAIR_TILE;
+                    continue;
+                }
+            }
+            unsigned mask = simd.overlapTile(columns, i, base) & allowed;
+            if (mask == 0) {
+                j = base + PAIR_TILE;
+                continue;
+            }
+            int k = __builtin_ctz(mask);
+            resolveCubePair<Policy>(world, i, base + k);
+            hits++;
+            j = base + k + 1;
+        }
+    }
+    return hits;
+}
+
+// Brings a body that is running at a slower rate up to the current time and
+// back to the base rate, because something is about to touch it.
+template <typename W>
+void flushBody(W& world, int i) {
+    if (world.due[i]) return;
+    integrateScalar(world.pointers(), i, i + 1, world.pendingDt[i]);
+    world.pendingDt[i] = 0.0f;
+    world.rateLevel[i] = 0;
+    world.due[i] = true;
+}
+
+// Multi-rate variant of the tiled pass. A body that did not move this step
+// is only tested against later bodies that did, so tiles holding no movers
+// are skipped without running the kernel; with every body moving this is
+// exactly the single-rate pass. The idle body of a hit is flushed and the
+// pair re-tested before it is resolved.
+template <typename Policy, typename W>
+int collidePairsTiledMultiRate(W& world) {
+    static std::vector<unsigned> dueBits;
+    dueBits.assign(tileRoundUp(world.count()) / PAIR_TILE, 0u);
+    for (int i = 0; i < world.count(); ++i) {
+        if (world.due[i]) dueBits[i / PAIR_TILE] |= 1u << (i % PAIR_TILE);
+    }
+
+    CubeColumnPointers columns = world.pointers();
+    int hits = 0;
+    for (int i = 0; i < world.count(); ++i) {
+        int j = i + 1;
+        while (j < world.count()) {
+            int base = j - j % PAIR_TILE;
+            unsigned allowed = (world.due[i] ? ~0u : dueBits[base / PAIR_TILE]) & (~0u << (j - base));
+            if constexpr (Policy::collisionLayers) {
+                if (allowed != 0) allowed &= layerTile(columns, i, base);
+            }
+            if (allowed == 0) {
+                j = base + PAIR_TILE;
+                continue;
+            }
+            if constexpr (Policy::instrument) {
+                stepStats.pairTests += __builtin_popcount(allowed & 0xffffu);
+            }
+
+            unsigned mask = simd.overlapTile(columns, i, base) & allowed;
+            if (mask == 0) {
+                j = base + PAIR_TILE;
+                continue;
+            }
+            int k = __builtin_ctz(mask);
+            flushBody(world, i);
+            flushBody(world, base + k);
+            dueBits[base / PAIR_TILE] |= 1u << k;
+            if (cubesOverlap(columns, i, base + k)) {
+                resolveCubePair<Policy>(world, i, base + k);
+                hits++;
+            }
+            j = base + k + 1;
+        }
+    }
+    return hits;
+}
+
+// Median-split AABB tree over boxes given by centre and edge length. Leaves
+// cover index[first, first + count); inner nodes have count 0 and children
+// at child and child + 1. Boxes are copied at build time. A tree over no
+// boxes has no nodes at all, so a count of 0 always means an inner node.
+struct BoxTree {
+    struct Node {
+        float minX, minY, minZ;
+        float maxX, maxY, maxZ;
+        int child;
+        int first, count;
+    };
+
+    static const int LEAF_SIZE = 4;
+
+    std::vector<Node> nodes;
+    std::vector<int> index;
+    std::vector<Vec3> centres;
+    std::vector<float> halves;
+
+    static bool overlaps(const Node& n, float minX, float minY, float minZ, float maxX, float maxY, float maxZ) {
+        return n.minX < maxX && n.maxX > minX && n.minY < maxY && n.maxY > minY && n.minZ < maxZ && n.maxZ > minZ;
+    }
+
+    static float axisOf(const Vec3& v, int axis) { return axis == 0 ? v.x : axis == 1 ? v.y : v.z; }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Squared distance from p to the node's box; 0 inside it.
+    static float distanceSquared(const Node& n, const Vec3& p) {
+        float dx = std::max(std::max(n.minX - p.x, p.x - n.maxX), 0.0f);
+        float dy = std::max(std::max(n.minY - p.y, p.y - n.maxY), 0.0f);
+        float dz = std::max(std::max(n.minZ - p.z, p.z - n.maxZ), 0.0f);
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    // Bounds of the boxes index[first, first + count).
+    Node fit(int first, int count) const {
+        Node bounds = {PADDING_POSITION, PADDING_POSITION, PADDING_POSITION, -PADDING_POSITION, -PADDING_POSITION, -PADDING_POSITION, 0, first, count};
+        for (int k = first; k < first + count; ++k) {
+            const Vec3& c = centres[index[k]];
+            float h = halves[index[k]];
+            bounds.minX = std::min(bounds.minX, c.x - h); bounds.maxX = std::max(bounds.maxX, c.x + h);
+            bounds.minY = std::min(bounds.minY, c.y - h); bounds.maxY = std::max(bounds.maxY, c.y + h);
+            bounds.minZ = std::min(bounds.minZ, c.z - h); bounds.maxZ = std::max(bounds.maxZ, c.z + h);
+        }
+        return bounds;
+    }
+
+    void buildNode(int node, int first, int count) {
+        Node bounds = fit(first, count);
+        nodes[node] = bounds;
+        if (count <= LEAF_SIZE) return;
+
+        // Median split on the longest axis.
+        float extentX = bounds.maxX - bounds.minX, extentY = bounds.maxY - bounds.minY, extentZ = bounds.maxZ - bounds.minZ;
+        int axis = extentX >= extentY && extentX >= extentZ ? 0 : extentY >= extentZ ? 1 : 2;
+        int half = count / 2;
+        std::nth_element(index.begin() + first, index.begin() + first + half, index.begin() + first + count,
+                         [this, axis](int a, int b) { return axisOf(centres[a], axis) < axisOf(centres[b], axis); });
+
+        int child = (int)nodes.size();
+        nodes.resize(nodes.size() + 2);
+        nodes[node].child = child;
+        nodes[node].count = 0;
+        buildNode(child, first, half);
+        buildNode(child + 1, first + half, count - half);
+    }
+
+    template <typename CentreAt, typename SizeAt>
+    void build(int count, CentreAt centreAt, SizeAt sizeAt) {
+        centres.resize(count);
+        halves.resize(count);
+        index.resize(count);
+        for (int k = 0; k < count; ++k) {
+            centres[k] = centreAt(k);
+            halves[k] = sizeAt(k) / 2.0f;
+            index[k] = k;
+        }
+        nodes.clear();
+        if (count == 0) return;
+        nodes.resize(1);
+        buildNode(0, 0, count);
+    }
+
+    // Moves the boxes and refits every node's bounds, keeping the topology.
+    // Children always sit after their parent, so one backward pass does it.
+    template <typename CentreAt, typename SizeAt>
+    void refit(CentreAt centreAt, SizeAt sizeAt) {
+        for (int k = 0; k < (int)centres.size(); ++k) {
+            centres[k] = centreAt(k);
+            halves[k] = sizeAt(k) / 2.0f;
+        }
+        for (int node = (int)nodes.size() - 1; node >= 0; --node) {
+            Node& n = nodes[node];
+            if (n.count > 0) {
+                n = fit(n.first, n.count);
+                continue;
+            }
+            const Node& a = nodes[n.child];
+            const Node& b = nodes[n.child + 1];
+            n.minX = std::min(a.minX, b.minX); n.maxX = std::max(a.maxX, b.maxX);
+            n.minY = std::min(a.minY, b.minY); n.maxY = std::max(a.maxY, b.maxY);
+            n.minZ = std::min(a.minZ, b.minZ); n.maxZ = std::max(a.maxZ, b.maxZ);
+        }
+    }
+
+    // Calls visit(k) for every box overlapping the query box.
+    template <typename Visit>
+    void query(float minX, float minY, float minZ, float maxX, float maxY, float maxZ, Visit visit) const {
+        if (empty()) return;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& n = nodes[stack[--top]];
+            if (!overlaps(n, minX, minY, minZ, maxX, maxY, maxZ)) continue;
+            if (n.count == 0) {
+                stack[top++] = n.child;
+                stack[top++] = n.child + 1;
+                continue;
+            }
+            for (int k = n.first; k < n.first + n.count; ++k) {
+                const Vec3& c = centres[index[k]];
+                float h = halves[index[k]];
+                if (c.x - h < maxX && c.x + h > minX && c.y - h < maxY && c.y + h > minY && c.z - h < maxZ && c.z + h > minZ) {
+                    visit(index[k]);
+                }
+            }
+        }
+    }
+
+    // The up to k boxes nearest to p, closest first, with their distances
+    // (0 for a box containing p). Returns how many were found. Nearer
+    // children are walked first, and subtrees no closer than the current
+    // k-th box are skipped.
+    int nearest(const Vec3& p, int k, int* found, float* distances) const {
+        if (k <= 0 || empty()) return 0;
+        int count = 0;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& n = nodes[stack[--top]];
+            float limit = count == k ? distances[k - 1] : PADDING_POSITION;
+            if (distanceSquared(n, p) >= limit) continue;
+            if (n.count == 0) {
+                bool firstNearer = distanceSquared(nodes[n.child], p) <= distanceSquared(nodes[n.child + 1], p);
+                stack[top++] = n.child + firstNearer;
+                stack[top++] = n.child + !firstNearer;
+                continue;
+            }
+            for (int m = n.first; m < n.first + n.count; ++m) {
+                const Vec3& c = centres[index[m]];
+                float h = halves[index[m]];
+                Node box = {c.x - h, c.y - h, c.z - h, c.x + h, c.y + h, c.z + h, 0, 0, 0};
+                float d2 = distanceSquared(box, p);
+                if (count == k && d2 >= distances[k - 1]) continue;
+                // Insertion into the sorted list, dropping the farthest when full.
+                int slot = count < k ? count++ : k - 1;
+                while (slot > 0 && distances[slot - 1] > d2) {
+                    distances[slot] = distances[slot - 1];
+                    found[slot] = found[slot - 1];
+                    slot--;
+                }
+                distances[slot] = d2;
+                found[slot] = index[m];
+            }
+        }
+        for (int m = 0; m < count; ++m) {
+            distances[m] = std::sqrt(distances[m]);
+        }
+        return count;
+    }
+};
+
+// Slab test of the packet's lanes [lane, lane + L::width) against a box:
+// all-ones where the ray enters it before its tmax and leaves it ahead of
+// the origin. Zero direction components are stored as 1e20 inverses rather
+// than infinities, so the products stay finite, as lessThan needs, for any
+// box within about 3.4e18 of the ray's origin. That covers every box a tree
+// holds; an empty tree has no root box to test.
+template <typename L>
+SIMD_INLINE typename L::I slabLanes(const RayPacket& r, int lane, float minX, float minY, float minZ,
+                                    float maxX, float maxY, float maxZ, typename L::F& entry) {
+    typedef typename L::F F;
+    F ox = loadLanes<L>(r.ox + lane), oy = loadLanes<L>(r.oy + lane), oz = loadLanes<L>(r.oz + lane);
+    F ix = loadLanes<L>(r.invX + lane), iy = loadLanes<L>(r.invY + lane), iz = loadLanes<L>(r.invZ + lane);
+    F ax = (minX - ox) * ix, bx = (maxX - ox) * ix;
+    F ay = (minY - oy) * iy, by = (maxY - oy) * iy;
+    F az = (minZ - oz) * iz, bz = (maxZ - oz) * iz;
+    F nearX = select<L>(lessThan<L>(ax, bx), ax, bx), farX = select<L>(lessThan<L>(ax, bx), bx, ax);
+    F nearY = select<L>(lessThan<L>(ay, by), ay, by), farY = select<L>(lessThan<L>(ay, by), by, ay);
+    F nearZ = select<L>(lessThan<L>(az, bz), az, bz), farZ = select<L>(lessThan<L>(az, bz), bz, az);
+    F nearXY = select<L>(lessThan<L>(nearX, nearY), nearY, nearX);
+    F farXY = select<L>(lessThan<L>(farX, farY), farX, farY);
+    entry = select<L>(lessThan<L>(nearXY, nearZ), nearZ, nearXY);
+    F exit = select<L>(lessThan<L>(farXY, farZ), farXY, farZ);
+    return ~lessThan<L>(exit, entry) & ~lessThan<L>(exit, splat<L>(0.0f)) & lessThan<L>(entry, loadLanes<L>(r.tmax + lane));
+}
+
+// Nearest entry distance over the lanes that hit the box, or
+// PADDING_POSITION if none does.
+template <typename L>
+SIMD_INLINE float packetEntry(const RayPacket& r, const BoxTree::Node& n) {
+    typedef typename L::F F;
+    float nearest = PADDING_POSITION;
+    for (int lane = 0; lane < RAY_PACKET; lane += L::width) {
+        F entry;
+        typename L::I hit = slabLanes<L>(r, lane, n.minX, n.minY, n.minZ, n.maxX, n.maxY, n.maxZ, entry);
+        F candidates = select<L>(hit, entry, splat<L>(PADDING_POSITION));
+        for (int k = 0; k < L::width; ++k) {
+            nearest = std::min(nearest, candidates[k]);
+        }
+    }
+    return nearest;
+}
+
+// Depth-first walk of the tree for a whole packet: a node is visited while
+// any lane can still hit it closer than that lane's current hit, the child
+// the packet enters first is taken first, and leaf boxes update the lanes
+// they are nearest for. A ray starting inside a box hits it at distance 0.
+template <typename L>
+SIMD_INLINE void castPacketLanes(const BoxTree& tree, RayPacket& r) {
+    typedef typename L::F F;
+    typedef typename L::I I;
+    struct Pending {
+        int node;
+        float entry;
+    };
+    Pending stack[64];
+    int top = 0;
+
+    if (tree.empty()) return;
+    float rootEntry = packetEntry<L>(r, tree.nodes[0]);
+    if (rootEntry < PADDING_POSITION) stack[top++] = {0, rootEntry};
+    while (top > 0) {
+        Pending pending = stack[--top];
+        float farthest = 0.0f;
+        for (int k = 0; k < RAY_PACKET; ++k) farthest = std::max(farthest, r.tmax[k]);
+        if (pending.entry >= farthest) continue;
+
+        const BoxTree::Node& n = tree.nodes[pending.node];
+        if (n.count == 0) {
+            float entry0 = packetEntry<L>(r, tree.nodes[n.child]);
+            float entry1 = packetEntry<L>(r, tree.nodes[n.child + 1]);
+            bool firstNearer = entry0 <= entry1;
+            Pending nearer = {firstNearer ? n.child : n.child + 1, std::min(entry0, entry1)};
+            Pending further = {firstNearer ? n.child + 1 : n.child, std::max(entry0, entry1)};
+            if (further.entry < PADDING_POSITION) stack[top++] = further;
+            if (nearer.entry < PADDING_POSITION) stack[top++] = nearer;
+            continue;
+        }
+
+        for (int m = n.first; m < n.first + n.count; ++m) {
+            int body = tree.index[m];
+            const Vec3& c = tree.centres[body];
+            float h = tree.halves[body];
+            for (int lane = 0; lane < RAY_PACKET; lane += L::width) {
+                F entry;
+                I hit = slabLanes<L>(r, lane, c.x - h, c.y - h, c.z - h, c.x + h, c.y + h, c.z + h, entry);
+                entry = select<L>(lessThan<L>(entry, splat<L>(0.0f)), splat<L>(0.0f), entry);
+                storeLanes<L>(r.tmax + lane, select<L>(hit, entry, loadLanes<L>(r.tmax + lane)));
+                I bodies;
+                memcpy(&bodies, r.body + lane, sizeof(bodies));
+                bodies = (hit & body) | (~hit & bodies);
+                memcpy(r.body + lane, &bodies, sizeof(bodies));
+            }
+        }
+    }
+}
+
+// The scalar baseline is the same walk one lane at a time.
+void castPacketScalar(const BoxTree& tree, RayPacket& packet) {
+    castPacketLanes<Lanes<1>>(tree, packet);
+}
+
+TARGET_SSE2 void castPacketSse2(const BoxTree& tree, RayPacket& packet) {
+    castPacketLanes<Lanes<4>>(tree, packet);
+}
+
+TARGET_AVX2 void castPacketAvx2(const BoxTree& tree, RayPacket& packet) {
+    castPacketLanes<Lanes<8>>(tree, packet);
+    _mm256_zeroupper();
+}
+
+// A packet is only eight lanes wide, so AVX-512 runs the AVX2 width.
+TARGET_AVX512 void castPacketAvx512(const BoxTree& tree, RayPacket& packet) {
+    castPacketLanes<Lanes<8>>(tree, packet);
+    _mm256_zeroupper();
+}
+
+// Root boxes of the consolidated piles. The broadphase files each one as a
+// single proxy beside the bodies and reports the bodies whose bounds meet it
+// as (body, compound) pairs, sorted, so a body only reaches a compound's
+// members through a candidate pair. foundStep is the step they were found
+// in; a pass that finds none leaves the tiled sweep to collideCompounds.
+struct CompoundProxies {
+    std::vector<BoxTree::Node> bounds;
+    std::vector<std::pair<int, int>> pairs;
+    unsigned long long foundStep = ~0ull;
+
+    int count() const { return (int)bounds.size(); }
+
+    Vec3 centre(int c) const {
+        const BoxTree::Node& b = bounds[c];
+        return Vec3((b.minX + b.maxX) / 2.0f, (b.minY + b.maxY) / 2.0f, (b.minZ + b.maxZ) / 2.0f);
+    }
+
+    // Edge of the cube around the box, for broadphases that only file cubes.
+    float size(int c) const {
+        const BoxTree::Node& b = bounds[c];
+        return std::max(std::max(b.maxX - b.minX, b.maxY - b.minY), b.maxZ - b.minZ);
+    }
+
+    template <typename W>
+    bool touches(const W& world, int i, int c) const {
+        float h = world.size[i] / 2.0f;
+        return BoxTree::overlaps(bounds[c], world.px[i] - h, world.py[i] - h, world.pz[i] - h, world.px[i] + h, world.py[i] + h, world.pz[i] + h);
+    }
+
+    void begin() {
+        pairs.clear();
+        foundStep = stepSerial;
+    }
+
+    void finish() {
+        std::sort(pairs.begin(), pairs.end());
+    }
+};
+
+CompoundProxies compoundProxies;
+
+// Level e has cells of 2^e metres and holds the cubes no larger than a
+// cell. A cube looks up the 27 cells around its centre on its own level and
+// on every coarser occupied level, so each pair is found once, from the
+// smaller cube, and a cube only ever meets cells of its own size or larger.
+// Only occupied cells are stored, so memory follows the bodies rather than
+// the extent of the world. Compound proxies are filed as entries count + c
+// by their bounding cube and only ever pair with bodies.
+struct HierarchicalGrid {
+    struct Entry {
+        uint64_t key;
+        int body;
+        bool operator<(const Entry& other) const { return key < other.key || (key == other.key && body < other.body); }
+    };
+
+    // An occupied cell: open-addressed by key, pointing at its run of entries.
+    struct Cell {
+        uint64_t key;
+        int begin, end;
+    };
+
+    struct Level {
+        int level;
+        float invCellSize;
+    };
+
+    static const int COORD_BITS = 18;
+    static const uint64_t COORD_MASK = (1u << COORD_BITS) - 1;
+    static const uint64_t EMPTY_CELL = ~0ull;
+
+    std::vector<Entry> entries;
+    std::vector<Cell> cells;
+    int cellBits = 0;
+    std::vector<int> bodyLevel;
+    std::vector<Vec3> proxyCentres;
+    std::vector<Level> levels;
+    std::vector<std::pair<int, int>> pairs;
+    // Cells are 2^levelBias times the size of the cubes filed in them.
+    int levelBias = 0;
+    // Work done by the last findPairs, for the adaptive broadphase.
+    long long lookups = 0;
+    long long candidates = 0;
+
+    int levelFor(float size) const {
+        int exponent;
+        std::frexp(size, &exponent);
+        return exponent + levelBias;
+    }
+
+    // Scaling by a power of two is exact, so this matches floor(x / 2^level).
+    static int cellCoord(float x, float invCellSize) {
+        float scaled = x * invCellSize;
+        int cell = (int)scaled;
+        return cell - (scaled < (float)cell);
+    }
+
+    // Coordinates wrap every 2^18 cells; aliased cells only add candidates
+    // that the exact overlap test rejects.
+    static uint64_t cellKey(int level, int x, int y, int z) {
+        return ((uint64_t)(level + 128) << (3 * COORD_BITS)) | (((uint64_t)x & COORD_MASK) << (2 * COORD_BITS))
+             | (((uint64_t)y & COORD_MASK) << COORD_BITS) | ((uint64_t)z & COORD_MASK);
+    }
+
+    size_t slotFor(uint64_t key) const { return (key * 0x9E3779B97F4A7C15ull) >> (64 - cellBits); }
+
+    const Cell* findCell(uint64_t key) const {
+        size_t mask = cells.size() - 1;
+        for (size_t slot = slotFor(key);; slot = (slot + 1) & mask) {
+            if (cells[slot].key == key) return &cells[slot];
+            if (cells[slot].key == EMPTY_CELL) return nullptr;
+        }
+    }
+
+    template <typename W>
+    void build(W& world) {
+        entries.clear();
+        levels.clear();
+        bodyLevel.resize(world.count() + compoundProxies.count());
+        proxyCentres.resize(compoundProxies.count());
+
+        auto file = [this](int i, const Vec3& centre, float size) {
+            int level = levelFor(size);
+            float invCellSize = std::ldexp(1.0f, -level);
+            bodyLevel[i] = level;
+            entries.push_back({cellKey(level, cellCoord(centre.x, invCellSize), cellCoord(centre.y, invCellSize), cellCoord(centre.z, invCellSize)), i});
+        };
+        for (int i = 0; i < world.count(); ++i) {
+            file(i, world.position(i), world.size[i]);
+        }
+        for (int c = 0; c < compoundProxies.count(); ++c) {
+            proxyCentres[c] = compoundProxies.centre(c);
+            file(world.count() + c, proxyCentres[c], compoundProxies.size(c));
+        }
+
+        std::sort(entries.begin(), entries.end());
+
+        // Keep the table at most half full.
+        int runs = 0;
+        for (int k = 0; k < (int)entries.size(); ++k) {
+            runs += k == 0 || entries[k].key != entries[k - 1].key;
+        }
+        cellBits = 4;
+        while ((1 << cellBits) < 2 * runs) cellBits++;
+        cells.assign((size_t)1 << cellBits, Cell{EMPTY_CELL, 0, 0});
+
+        size_t mask = cells.size() - 1;
+        for (int k = 0; k < (int)entries.size(); ++k) {
+            if (k > 0 && entries[k].key == entries[k - 1].key) continue;
+            size_t slot = slotFor(entries[k].key);
+            while (cells[slot].key != EMPTY_CELL) slot = (slot + 1) & mask;
+            int end = k + 1;
+            while (end < (int)entries.size() && entries[end].key == entries[k].key) end++;
+            cells[slot] = {entries[k].key, k, end};
+
+            int level = bodyLevel[entries[k].body];
+            if (levels.empty() || levels.back().level != level) {
+                levels.push_back({level, std::ldexp(1.0f, -level)});
+            }
+        }
+    }
+
+    // Overlapping pairs (i < j), sorted so they resolve in the same order
+    // as the tiled broadphase. With filterLayers, pairs whose layers do not
+    // collide are dropped before their bounds are compared.
+    template <bool filterLayers, typename W>
+    void findPairs(W& world) {
+        build(world);
+        pairs.clear();
+        compoundProxies.begin();
+        lookups = candidates = 0;
+
+        CubeColumnPointers columns = world.pointers();
+        int count = world.count();
+        // Walking bodies in cell order keeps successive lookups in cache.
+        for (const Entry& entry : entries) {
+            int i = entry.body;
+            bool proxy = i >= count;
+            if (filterLayers && !proxy && world.mask[i] == 0) continue;
+            Vec3 centre = proxy ? proxyCentres[i - count] : world.position(i);
+            for (const Level& level : levels) {
+                if (level.level < bodyLevel[i]) continue;
+                bool sameLevel = level.level == bodyLevel[i];
+
+                int cx = cellCoord(centre.x, level.invCellSize);
+                int cy = cellCoord(centre.y, level.invCellSize);
+                int cz = cellCoord(centre.z, level.invCellSize);
+
+                for (int dx = -1; dx <= 1; ++dx)
+                for (int dy = -1; dy <= 1; ++dy)
+                for (int dz = -1; dz <= 1; ++dz) {
+                    const Cell* cell = findCell(cellKey(level.level, cx + dx, cy + dy, cz + dz));
+                    lookups++;
+                    if (!cell) continue;
+                    candidates += cell->end - cell->begin;
+                    for (int k = cell->begin; k < cell->end; ++k) {
+                        int j = entries[k].body;
+                        // Same-level pairs are seen from both cubes; keep one.
+                        if (sameLevel && j <= i) continue;
+                        if (proxy || j >= count) {
+                            if (proxy == (j >= count)) continue;
+                            int body = proxy ? j : i, c = (proxy ? i : j) - count;
+                            if (compoundProxies.touches(world, body, c)) compoundProxies.pairs.push_back({body, c});
+                            continue;
+                        }
+                        if (filterLayers && !layersCollide(columns, i, j)) continue;
+                        if (cubesOverlap(columns, i, j)) {
+                            pairs.push_back({std::min(i, j), std::max(i, j)});
+                        }
+                    }
+                }
+            }
+        }
+
+        std::sort(pairs.begin(), pairs.end());
+        compoundProxies.finish();
+    }
+};
+
+HierarchicalGrid hierarchicalGrid;
+
+// Overlapping pairs (i < j) from a tree over the bodies' bounds, sorted like
+// the grid's. Rebuilding is O(n log n) but needs no cell size, which suits
+// sparse scenes where most grid cells would hold a single cube. Compound
+// proxies are leaves count + c, bounded by their cube.
+struct BodyTreeBroadphase {
+    BoxTree tree;
+    std::vector<std::pair<int, int>> pairs;
+    unsigned long long builtStep = ~0ull;
+    long long candidates = 0;
+
+    template <bool filterLayers, typename W>
+    void findPairs(W& world) {
+        int count = world.count();
+        tree.build(count + compoundProxies.count(),
+                   [&world, count](int i) { return i < count ? world.position(i) : compoundProxies.centre(i - count); },
+                   [&world, count](int i) { return i < count ? world.size[i] : compoundProxies.size(i - count); });
+        builtStep = stepSerial;
+        pairs.clear();
+        compoundProxies.begin();
+        candidates = 0;
+
+        CubeColumnPointers columns = world.pointers();
+        for (int i = 0; i < count; ++i) {
+            if (filterLayers && world.mask[i] == 0) continue;
+            float h = world.size[i] / 2.0f;
+            tree.query(world.px[i] - h, world.py[i] - h, world.pz[i] - h, world.px[i] + h, world.py[i] + h, world.pz[i] + h, [&](int j) {
+                candidates++;
+                if (j >= count) {
+                    if (compoundProxies.touches(world, i, j - count)) compoundProxies.pairs.push_back({i, j - count});
+                    return;
+                }
+                if (j <= i || (filterLayers && !layersCollide(columns, i, j))) return;
+                if (cubesOverlap(columns, i, j)) pairs.push_back({i, j});
+            });
+        }
+
+        std::sort(pairs.begin(), pairs.end());
+        compoundProxies.finish();
+    }
+};
+
+BodyTreeBroadphase bodyTree;
+
+// Candidate pairs (i < j) whose bounds overlap, from the tiled sweep.
+template <typename Policy, typename W>
+void collectPairsTiled(W& world, std::vector<std::pair<int, int>>& pairs) {
+    CubeColumnPointers columns = world.pointers();
+    pairs.clear();
+    for (int i = 0; i < world.count(); ++i) {
+        int j = i + 1;
+        while (j < world.count()) {
+            int base = j - j % PAIR_TILE;
+            unsigned allowed = ~0u << (j - base);
+            if constexpr (Policy::collisionLayers) {
+                allowed &= layerTile(columns, i, base);
+            }
+            unsigned mask = allowed ? simd.overlapTile(columns, i, base) & allowed : 0u;
+            while (mask) {
+                pairs.push_back({i, base + __builtin_ctz(mask)});
+                mask &= mask - 1;
+            }
+            j = base + PAIR_TILE;
+        }
+    }
+}
+
+// Pairs come from positions before any contact is resolved, so each one is
+// re-tested first: an earlier resolution may already have separated it.
+template <typename Policy, typename W, int A, int B>
+int resolveBucket(W& world, const std::vector<std::pair<int, int>>& pairs) {
+    CubeColumnPointers columns = world.pointers();
+    int hits = 0;
+    for (const std::pair<int, int>& pair : pairs) {
+        if constexpr (Policy::multiRate) {
+            if (!world.due[pair.first] && !world.due[pair.second]) continue;
+            flushBody(world, pair.first);
+            flushBody(world, pair.second);
+        }
+        if constexpr (Policy::instrument) {
+            stepStats.pairTests++;
+        }
+        if (cubesOverlap(columns, pair.first, pair.second)) {
+            resolveShapePairOf<Policy, W, A, B>(world, pair.first, pair.second);
+            hits++;
+        }
+    }
+    return hits;
+}
+
+// Splits the pairs by shape combination and runs each bucket through its
+// own loop, so the narrowphase kernel is chosen once per bucket rather than
+// once per pair. Within a bucket pairs keep their sorted order.
+template <typename Policy, typename W>
+int resolveShapeBuckets(W& world, const std::vector<std::pair<int, int>>& pairs) {
+    using Loop = int (*)(W& world, const std::vector<std::pair<int, int>>& pairs);
+    static constexpr Loop loops[NUM_SHAPES * NUM_SHAPES] = {
+        resolveBucket<Policy, W, SHAPE_BOX, SHAPE_BOX>, resolveBucket<Policy, W, SHAPE_BOX, SHAPE_SPHERE>, resolveBucket<Policy, W, SHAPE_BOX, SHAPE_CAPSULE>,
+        resolveBucket<Policy, W, SHAPE_SPHERE, SHAPE_BOX>, resolveBucket<Policy, W, SHAPE_SPHERE, SHAPE_SPHERE>, resolveBucket<Policy, W, SHAPE_SPHERE, SHAPE_CAPSULE>,
+        resolveBucket<Policy, W, SHAPE_CAPSULE, SHAPE_BOX>, resolveBucket<Policy, W, SHAPE_CAPSULE, SHAPE_SPHERE>, resolveBucket<Policy, W, SHAPE_CAPSULE, SHAPE_CAPSULE>,
+    };
+    static std::vector<std::pair<int, int>> buckets[NUM_SHAPES * NUM_SHAPES];
+
+    for (auto& bucket : buckets) bucket.clear();
+    for (const std::pair<int, int>& pair : pairs) {
+        buckets[world.shape[pair.first] * NUM_SHAPES + world.shape[pair.second]].push_back(pair);
+    }
+    int hits = 0;
+    for (int b = 0; b < NUM_SHAPES * NUM_SHAPES; ++b) {
+        if (!buckets[b].empty()) hits += loops[b](world, buckets[b]);
+    }
+    return hits;
+}
+
+// Returns the number of contacts found.
+template <typename Policy, typename W>
+int resolvePairList(W& world, const std::vector<std::pair<int, int>>& pairs) {
+    if constexpr (Policy::mixedShapes) {
+        return resolveShapeBuckets<Policy>(world, pairs);
+    } else {
+        return resolveBucket<Policy, W, SHAPE_BOX, SHAPE_BOX>(world, pairs);
+    }
+}
+
+template <typename Policy, typename W>
+int collidePairsGrid(W& world) {
+    hierarchicalGrid.findPairs<Policy::collisionLayers>(world);
+    return resolvePairList<Policy>(world, hierarchicalGrid.pairs);
+}
+
+template <typename Policy, typename W>
+int collidePairsTree(W& world) {
+    bodyTree.findPairs<Policy::collisionLayers>(world);
+    return resolvePairList<Policy>(world, bodyTree.pairs);
+}
+
+template <typename Policy, typename W>
+int collidePairsTiledAnyRate(W& world) {
+    if constexpr (Policy::mixedShapes) {
+        static std::vector<std::pair<int, int>> pairs;
+        collectPairsTiled<Policy>(world, pairs);
+        return resolvePairList<Policy>(world, pairs);
+    } else if constexpr (Policy::multiRate) {
+        return collidePairsTiledMultiRate<Policy>(world);
+    } else {
+        return collidePairsTiled<Policy>(world);
+    }
+}
+
+enum class BroadphaseKind { Tiled, Grid, Tree };
+
+struct BroadphaseChoice {
+    BroadphaseKind kind;
+    int levelBias;
+    const char* name;
+};
+
+const BroadphaseChoice BROADPHASE_CHOICES[] = {
+    {BroadphaseKind::Tiled, 0, "tiled"},
+    {BroadphaseKind::Grid, 0, "grid"},
+    {BroadphaseKind::Grid, 1, "grid x2"},
+    {BroadphaseKind::Grid, 2, "grid x4"},
+    {BroadphaseKind::Tree, 0, "tree"},
+};
+const int NUM_BROADPHASE_CHOICES = sizeof(BROADPHASE_CHOICES) / sizeof(BROADPHASE_CHOICES[0]);
+
+// Keeps a running cost for each broadphase choice. The current choice is
+// costed every step; at most every ADAPT_PROBE_INTERVAL steps another choice
+// that is due runs for ADAPT_PROBE_STEPS steps, and it takes over if it was
+// cheaper by more than ADAPT_HYSTERESIS. A choice that loses by more than
+// that waits twice as long for its next probe, up to
+// ADAPT_MAX_PROBE_INTERVAL steps, so a clear winner is not interrupted on a
+// fixed schedule. Costs are counted work, not time: the grid and
+// tree resolve a candidate list gathered up front while the tiled pass
+// re-tests against moved bodies, so the choice changes the trajectory, and
+// a replay has to make the same choices on any machine and under any load.
+struct BroadphaseTuner {
+    int current = 0;
+    int probing = -1;
+    int nextProbe = 1;
+    int step = 0;
+    int stepsSinceProbe = 0;
+    int probeSteps = 0;
+    int probeInterval[NUM_BROADPHASE_CHOICES];
+    int probeDue[NUM_BROADPHASE_CHOICES];
+    float cost[NUM_BROADPHASE_CHOICES] = {};
+    bool measured[NUM_BROADPHASE_CHOICES] = {};
+    float contactsPerStep = 0.0f;
+
+    BroadphaseTuner() {
+        for (int k = 0; k < NUM_BROADPHASE_CHOICES; ++k) {
+            probeInterval[k] = probeDue[k] = ADAPT_PROBE_INTERVAL;
+        }
+    }
+
+    // A new scene keeps the current choice but is measured afresh.
+    void restart() {
+        int keep = current;
+        *this = BroadphaseTuner();
+        current = keep;
+    }
+
+    bool usable(int choice, int bodies) const {
+        return BROADPHASE_CHOICES[choice].kind != BroadphaseKind::Tiled || bodies <= ADAPT_TILED_MAX_BODIES;
+    }
+
+    int pickChoice(int bodies) {
+        step++;
+        if (probing < 0 && ++stepsSinceProbe >= ADAPT_PROBE_INTERVAL) {
+            for (int tries = 0; tries < NUM_BROADPHASE_CHOICES; ++tries) {
+                int choice = nextProbe;
+                nextProbe = (nextProbe + 1) % NUM_BROADPHASE_CHOICES;
+                if (choice != current && usable(choice, bodies) && step >= probeDue[choice]) {
+                    probing = choice;
+                    probeSteps = 0;
+                    stepsSinceProbe = 0;
+                    measured[choice] = false;
+                    break;
+                }
+            }
+        }
+        return probing >= 0 ? probing : current;
+    }
+
+    // Work of the pass just run, in scalar bounds tests. One overlap kernel
+    // call covers a tile of later bodies; building the grid or tree sorts
+    // the bodies, and the tree also descends once per body.
+    static float passWork(const BroadphaseChoice& use, int bodies, int contacts) {
+        const float TILE_TEST_COST = 4.0f;
+        const float CELL_LOOKUP_COST = 2.0f;
+        float sortCost = bodies * std::log2((float)std::max(bodies, 2));
+        if (use.kind == BroadphaseKind::Tiled) {
+            float tiles = (float)bodies * (float)(bodies + PAIR_TILE) / (2.0f * PAIR_TILE);
+            return (tiles + contacts) * TILE_TEST_COST;
+        } else if (use.kind == BroadphaseKind::Grid) {
+            return sortCost + hierarchicalGrid.lookups * CELL_LOOKUP_COST + hierarchicalGrid.candidates;
+        } else {
+            return 2.0f * sortCost + bodyTree.candidates;
+        }
+    }
+
+    template <typename Policy>
+    void record(int choice, float work, int contacts, int bodies) {
+        cost[choice] = measured[choice] ? cost[choice] + (work - cost[choice]) * 0.25f : work;
+        measured[choice] = true;
+        contactsPerStep += (contacts - contactsPerStep) * 0.25f;
+
+        if (choice != probing || ++probeSteps < ADAPT_PROBE_STEPS) return;
+        probing = -1;
+        if (cost[choice] < cost[current] * (1.0f - ADAPT_HYSTERESIS) || !usable(current, bodies)) {
+            if constexpr (Policy::instrument) {
+                std::cout << "Broadphase: " << BROADPHASE_CHOICES[current].name << " -> " << BROADPHASE_CHOICES[choice].name
+                          << " (" << cost[choice] << " vs " << cost[current] << " tests, "
+                          << bodies << " bodies, " << contactsPerStep << " contacts/step)" << std::endl;
+            }
+            probeInterval[current] = ADAPT_PROBE_INTERVAL;
+            probeDue[current] = step + ADAPT_PROBE_INTERVAL;
+            current = choice;
+        } else {
+            if (cost[choice] > cost[current] * (1.0f + ADAPT_HYSTERESIS)) {
+                probeInterval[choice] = std::min(2 * probeInterval[choice], ADAPT_MAX_PROBE_INTERVAL);
+            }
+            probeDue[choice] = step + probeInterval[choice];
+        }
+    }
+
+    template <typename Policy, typename W>
+    void run(W& world) {
+        int choice = pickChoice(world.count());
+        if (!usable(choice, world.count())) {
+            // Scene grew past what the tiled pass can afford; fall back to the grid.
+            current = choice = 1;
+        }
+        const BroadphaseChoice& use = BROADPHASE_CHOICES[choice];
+
+        int contacts;
+        if (use.kind == BroadphaseKind::Tiled) {
+            contacts = collidePairsTiledAnyRate<Policy>(world);
+        } else if (use.kind == BroadphaseKind::Grid) {
+            hierarchicalGrid.levelBias = use.levelBias;
+            contacts = collidePairsGrid<Policy>(world);
+        } else {
+            contacts = collidePairsTree<Policy>(world);
+        }
+        record<Policy>(choice, passWork(use, world.count(), contacts), contacts, world.count());
+    }
+};
+
+BroadphaseTuner broadphaseTuner;
+
+void restartBroadphaseTuner() {
+    broadphaseTuner.restart();
+}
+
+template <typename Policy, typename W>
+void collidePairs(W& world) {
+    if constexpr (std::is_same<typename Policy::Broadphase, AdaptiveBroadphase>::value) {
+        broadphaseTuner.run<Policy>(world);
+    } else if constexpr (std::is_same<typename Policy::Broadphase, HierarchicalGridBroadphase>::value) {
+        collidePairsGrid<Policy>(world);
+    } else {
+        collidePairsTiledAnyRate<Policy>(world);
+    }
+}
+
+// Pair pass under a wall-clock deadline. Bodies go in priority order:
+// those deferred longest first, then fast bodies near the camera focus, with
+// far, slow ones last. A body's pairs with every body after it in that order
+// are resolved together; when the deadline passes the remaining bodies are
+// deferred to the next step, where they go first. stepStats.deferred reports
+// how many there were.
+template <typename Policy, typename W>
+void collidePairsBudgeted(W& world, std::chrono::steady_clock::time_point deadline) {
+    static std::vector<int> order;
+    static std::vector<float> urgency;
+    static std::vector<int> rank;
+    static std::vector<float> rankedX, rankedY, rankedZ, rankedSize;
+    static std::vector<unsigned> rankedLayer, rankedMask;
+    static std::vector<unsigned char> pending;
+
+    int count = world.count();
+    order.resize(count);
+    urgency.resize(count);
+    for (int i = 0; i < count; ++i) {
+        urgency[i] = world.velocity(i).length() / (1.0f + world.position(i).length());
+    }
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&world](int a, int b) {
+        if (world.deferredSteps[a] != world.deferredSteps[b]) return world.deferredSteps[a] > world.deferredSteps[b];
+        return urgency[a] > urgency[b];
+    });
+
+    CubeColumnPointers columns = world.pointers();
+    auto resolve = [&world, &columns](int i, int j) {
+        if constexpr (Policy::multiRate) {
+            if (!world.due[i] && !world.due[j]) return;
+            flushBody(world, i);
+            flushBody(world, j);
+        }
+        if constexpr (Policy::instrument) {
+            stepStats.pairTests++;
+        }
+        if (cubesOverlap(columns, i, j)) {
+            resolveBodyPair<Policy>(world, i, j);
+        }
+    };
+
+    pending.assign(count, 0);
+    if constexpr (std::is_same<typename Policy::Broadphase, HierarchicalGridBroadphase>::value) {
+        // Pairs take the rank of their more urgent body.
+        hierarchicalGrid.findPairs<Policy::collisionLayers>(world);
+        rank.resize(count);
+        for (int k = 0; k < count; ++k) rank[order[k]] = k;
+        std::vector<std::pair<int, int>>& pairs = hierarchicalGrid.pairs;
+        std::stable_sort(pairs.begin(), pairs.end(), [](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+            return std::min(rank[a.first], rank[a.second]) < std::min(rank[b.first], rank[b.second]);
+        });
+
+        size_t next = 0;
+        for (; next < pairs.size(); ++next) {
+            if (next > 0 && next % BUDGET_CHECK_INTERVAL == 0 && std::chrono::steady_clock::now() >= deadline) break;
+            resolve(pairs[next].first, pairs[next].second);
+        }
+        for (; next < pairs.size(); ++next) {
+            pending[pairs[next].first] = pending[pairs[next].second] = 1;
+        }
+    } else {
+        // The tiled sweep runs over copies of the bounds gathered in
+        // priority order, so rank r only tests ranks above r and the
+        // deferred tail is exactly the lowest ranks.
+        int capacity = tileRoundUp(count);
+        for (auto* column : {&rankedX, &rankedY, &rankedZ, &rankedSize}) {
+            column->assign(capacity, 0.0f);
+        }
+        rankedLayer.assign(capacity, 0u);
+        rankedMask.assign(capacity, 0u);
+        for (int r = 0; r < capacity; ++r) {
+            if (r < count) {
+                int i = order[r];
+                rankedX[r] = world.px[i]; rankedY[r] = world.py[i]; rankedZ[r] = world.pz[i];
+                rankedSize[r] = world.size[i];
+                rankedLayer[r] = world.layer[i]; rankedMask[r] = world.mask[i];
+            } else {
+                rankedX[r] = rankedY[r] = rankedZ[r] = PADDING_POSITION;
+            }
+        }
+        CubeColumnPointers ranked = {};
+        ranked.px = rankedX.data(); ranked.py = rankedY.data(); ranked.pz = rankedZ.data();
+        ranked.size = rankedSize.data();
+        ranked.layer = rankedLayer.data(); ranked.mask = rankedMask.data();
+
+        int next = 0;
+        for (; next < count; ++next) {
+            if (next > 0 && next % BUDGET_CHECK_INTERVAL == 0 && std::chrono::steady_clock::now() >= deadline) break;
+
+            int j = next + 1;
+            while (j < count) {
+                int base = j - j % PAIR_TILE;
+                unsigned allowed = ~0u << (j - base);
+                if constexpr (Policy::collisionLayers) {
+                    allowed &= layerTile(ranked, next, base);
+                    if (allowed == 0) {
+                        j = base + PAIR_TILE;
+                        continue;
+                    }
+                }
+                unsigned mask = simd.overlapTile(ranked, next, base) & allowed;
+                if (mask == 0) {
+                    j = base + PAIR_TILE;
+                    continue;
+                }
+                int k = base + __builtin_ctz(mask);
+                int a = order[next], b = order[k];
+                resolve(std::min(a, b), std::max(a, b));
+                rankedX[next] = world.px[a]; rankedY[next] = world.py[a]; rankedZ[next] = world.pz[a];
+                rankedX[k] = world.px[b]; rankedY[k] = world.py[b]; rankedZ[k] = world.pz[b];
+                j = k + 1;
+            }
+        }
+        for (; next < count; ++next) {
+            pending[order[next]] = 1;
+        }
+    }
+
+    stepStats.deferred = 0;
+    for (int i = 0; i < count; ++i) {
+        if (pending[i]) {
+            if (world.deferredSteps[i] < 255) world.deferredSteps[i]++;
+            stepStats.deferred++;
+        } else {
+            world.deferredSteps[i] = 0;
+        }
+    }
+}
+
+// A settled pile held outside the world's columns as one static body. The
+// broadphase only sees its bounds; contacts inside them go through a tree
+// over the members, built once when the pile is merged or split.
+struct CompoundBody {
+    std::vector<BodyRecord> members;
+    BoxTree tree;
+    std::vector<Matrix4> transforms;
+
+    void build() {
+        tree.build((int)members.size(), [this](int k) {
+            const BodyRecord& r = members[k];
+            return Vec3(r.px, r.py, r.pz);
+        }, [this](int k) { return members[k].size; });
+
+        transforms.resize(members.size());
+        for (size_t k = 0; k < members.size(); ++k) {
+            const BodyRecord& r = members[k];
+            Quat q = Quat(r.qw, r.qx, r.qy, r.qz).renormalized();
+            writeTransform(transforms[k], r.px, r.py, r.pz, q.w, q.x, q.y, q.z, r.size / 2.0f);
+        }
+    }
+
+    bool built() const { return !tree.nodes.empty(); }
+
+    void shift(float dx, float dz) {
+        for (BodyRecord& r : members) {
+            r.px += dx;
+            r.pz += dz;
+        }
+        build();
+    }
+};
+
+std::vector<CompoundBody> compounds;
+
+// Runs whenever compounds are merged, split or dropped.
+void refreshCompoundProxies() {
+    compoundProxies.bounds.clear();
+    for (const CompoundBody& compound : compounds) {
+        compoundProxies.bounds.push_back(compound.tree.nodes[0]);
+    }
+}
+
+void clearCompounds() {
+    compounds.clear();
+    refreshCompoundProxies();
+}
+
+int findRoot(std::vector<int>& parent, int k) {
+    while (parent[k] != k) {
+        parent[k] = parent[parent[k]];
+        k = parent[k];
+    }
+    return k;
+}
+
+// Bodies that have rested for CONSOLIDATE_AFTER_SECONDS are grouped into
+// touching piles with a sweep along x; every pile of MIN_COMPOUND_BODIES or
+// more leaves the world as one compound.
+template <typename Policy, typename W>
+void consolidatePiles(W& world) {
+    static std::vector<int> settled, parent, keep;
+    settled.clear();
+    for (int i = 0; i < world.count(); ++i) {
+        if (world.restTime[i] >= CONSOLIDATE_AFTER_SECONDS) settled.push_back(i);
+    }
+    if ((int)settled.size() < MIN_COMPOUND_BODIES) return;
+
+    std::sort(settled.begin(), settled.end(), [&world](int a, int b) {
+        return world.px[a] - world.size[a] / 2.0f < world.px[b] - world.size[b] / 2.0f;
+    });
+    parent.resize(settled.size());
+    for (size_t k = 0; k < settled.size(); ++k) parent[k] = (int)k;
+
+    // Bodies whose layers pass through each other are not one pile.
+    CubeColumnPointers columns = world.pointers();
+    for (size_t a = 0; a < settled.size(); ++a) {
+        int i = settled[a];
+        float h1 = world.size[i] / 2.0f + COMPOUND_CONTACT_MARGIN;
+        for (size_t b = a + 1; b < settled.size(); ++b) {
+            int j = settled[b];
+            float h2 = world.size[j] / 2.0f;
+            if (world.px[j] - h2 > world.px[i] + h1) break;
+            if (Policy::collisionLayers && !layersCollide(columns, i, j)) continue;
+            if (std::fabs(world.py[i] - world.py[j]) < h1 + h2 && std::fabs(world.pz[i] - world.pz[j]) < h1 + h2) {
+                parent[findRoot(parent, (int)a)] = findRoot(parent, (int)b);
+            }
+        }
+    }
+
+    // Group members by root; piles too small to merge stay in the world.
+    std::vector<int> pileSize(settled.size(), 0);
+    for (size_t k = 0; k < settled.size(); ++k) pileSize[findRoot(parent, (int)k)]++;
+
+    std::vector<int> pileCompound(settled.size(), -1);
+    std::vector<unsigned char> merged(world.count(), 0);
+    int consolidated = 0;
+    for (size_t k = 0; k < settled.size(); ++k) {
+        int root = findRoot(parent, (int)k);
+        if (pileSize[root] < MIN_COMPOUND_BODIES) continue;
+        if (pileCompound[root] < 0) {
+            pileCompound[root] = (int)compounds.size();
+            compounds.push_back(CompoundBody());
+        }
+        int i = settled[k];
+        BodyRecord member = world.record(i, Vec3());
+        Quat q = world.orientationAt(i, simulationTime);
+        member.qw = q.w; member.qx = q.x; member.qy = q.y; member.qz = q.z;
+        member.wx = member.wy = member.wz = 0.0f;
+        member.rotationTime = simulationTime;
+        compounds[pileCompound[root]].members.push_back(member);
+        merged[i] = 1;
+        consolidated++;
+    }
+    if (consolidated == 0) return;
+
+    for (CompoundBody& compound : compounds) {
+        if (!compound.built()) compound.build();
+    }
+    refreshCompoundProxies();
+
+    keep.clear();
+    for (int i = 0; i < world.count(); ++i) {
+        if (!merged[i]) keep.push_back(i);
+    }
+    world.compact(keep);
+
+    if constexpr (Policy::instrument) {
+        std::cout << "Consolidated " << consolidated << " resting bodies; " << compounds.size()
+                  << " compounds, " << world.count() << " dynamic bodies" << std::endl;
+    }
+}
+
+// Members within COMPOUND_SPLIT_RADIUS of an impact rejoin the world as
+// dynamic bodies; a compound left with too few members dissolves.
+template <typename W>
+void splitCompound(W& world, int c, const Vec3& impact) {
+    CompoundBody& compound = compounds[c];
+    size_t remaining = 0;
+    for (size_t k = 0; k < compound.members.size(); ++k) {
+        const BodyRecord& r = compound.members[k];
+        Vec3 offset = Vec3(r.px, r.py, r.pz) - impact;
+        if (offset.length() < COMPOUND_SPLIT_RADIUS + r.size / 2.0f) {
+            world.append(r, Vec3());
+        } else {
+            compound.members[remaining++] = r;
+        }
+    }
+    compound.members.resize(remaining);
+
+    if ((int)remaining < MIN_COMPOUND_BODIES) {
+        for (const BodyRecord& r : compound.members) world.append(r, Vec3());
+        compound.members.clear();
+    } else {
+        compound.build();
+    }
+}
+
+// Contact of dynamic cube i with a member of compound c, which does not
+// move. Returns the approach speed at the contact, before the response.
+template <typename Policy, typename W>
+float collideWithMember(W& world, int i, int c, const BodyRecord& member) {
+    float h1 = world.size[i] / 2.0f;
+    float h2 = member.size / 2.0f;
+    float overlap_x = h1 + h2 - std::fabs(world.px[i] - member.px);
+    float overlap_y = h1 + h2 - std::fabs(world.py[i] - member.py);
+    float overlap_z = h1 + h2 - std::fabs(world.pz[i] - member.pz);
+    if (overlap_x <= 0.0f || overlap_y <= 0.0f || overlap_z <= 0.0f) return 0.0f;
+
+    Vec3 normal;
+    if (overlap_x < overlap_y && overlap_x < overlap_z) {
+        normal = Vec3(world.px[i] > member.px ? 1.0f : -1.0f, 0.0f, 0.0f);
+        world.px[i] += normal.x * (overlap_x + 0.001f);
+    } else if (overlap_y < overlap_x && overlap_y < overlap_z) {
+        normal = Vec3(0.0f, world.py[i] > member.py ? 1.0f : -1.0f, 0.0f);
+        world.py[i] += normal.y * (overlap_y + 0.001f);
+    } else {
+        normal = Vec3(0.0f, 0.0f, world.pz[i] > member.pz ? 1.0f : -1.0f);
+        world.pz[i] += normal.z * (overlap_z + 0.001f);
+    }
+
+    Vec3 r = normal * -h1;
+    float approach = -(world.velocity(i) + world.angularVelocity(i).cross(r)).dot(normal);
+    float impulse = bounceOffPlane<Policy>(world, i, normal);
+    if constexpr (Policy::instrument) {
+        stepStats.contacts++;
+    }
+    if constexpr (Policy::contactEvents) {
+        contactStream.record(i, c, CONTACT_COMPOUND, impulse, world.position(i) + r);
+    }
+    return approach;
+}
+
+// The tiled broadphase's share of the proxies: each proxy's bounding cube
+// is swept over the body tiles with the overlap kernel. The kernel reads
+// both sides from one set of columns, so the bounds are copied with the
+// proxies after the bodies.
+template <typename W>
+void findCompoundPairsTiled(W& world) {
+    static std::vector<float> boundsX, boundsY, boundsZ, boundsSize;
+    int count = world.count();
+    int capacity = tileRoundUp(count + compoundProxies.count());
+    for (auto* column : {&boundsX, &boundsY, &boundsZ}) {
+        column->assign(capacity, PADDING_POSITION);
+    }
+    boundsSize.assign(capacity, 0.0f);
+    std::copy(world.px.begin(), world.px.begin() + count, boundsX.begin());
+    std::copy(world.py.begin(), world.py.begin() + count, boundsY.begin());
+    std::copy(world.pz.begin(), world.pz.begin() + count, boundsZ.begin());
+    std::copy(world.size.begin(), world.size.begin() + count, boundsSize.begin());
+    for (int c = 0; c < compoundProxies.count(); ++c) {
+        Vec3 centre = compoundProxies.centre(c);
+        boundsX[count + c] = centre.x; boundsY[count + c] = centre.y; boundsZ[count + c] = centre.z;
+        boundsSize[count + c] = compoundProxies.size(c);
+    }
+    CubeColumnPointers columns = {};
+    columns.px = boundsX.data(); columns.py = boundsY.data(); columns.pz = boundsZ.data();
+    columns.size = boundsSize.data();
+
+    compoundProxies.begin();
+    for (int c = 0; c < compoundProxies.count(); ++c) {
+        for (int base = 0; base < count; base += PAIR_TILE) {
+            unsigned mask = simd.overlapTile(columns, count + c, base);
+            if (count - base < PAIR_TILE) mask &= (1u << (count - base)) - 1;
+            while (mask) {
+                int i = base + __builtin_ctz(mask);
+                if (compoundProxies.touches(world, i, c)) compoundProxies.pairs.push_back({i, c});
+                mask &= mask - 1;
+            }
+        }
+    }
+    compoundProxies.finish();
+}
+
+// Bodies meet compounds only through the proxy pairs of this step's
+// broadphase. The grid and tree find theirs before the pair pass moves
+// anything, so each pair is re-tested against the members.
+template <typename Policy, typename W>
+void collideCompounds(W& world) {
+    static std::vector<int> hits;
+    static std::vector<std::pair<int, Vec3>> impacts;
+    if (compounds.empty()) return;
+    impacts.clear();
+
+    if (compoundProxies.foundStep != stepSerial) findCompoundPairsTiled(world);
+
+    for (const std::pair<int, int>& pair : compoundProxies.pairs) {
+        int i = pair.first, c = pair.second;
+        const CompoundBody& compound = compounds[c];
+        if constexpr (Policy::instrument) {
+            stepStats.pairTests++;
+        }
+        float h = world.size[i] / 2.0f;
+        hits.clear();
+        compound.tree.query(world.px[i] - h, world.py[i] - h, world.pz[i] - h, world.px[i] + h, world.py[i] + h, world.pz[i] + h,
+                            [](int k) { hits.push_back(k); });
+        for (int k : hits) {
+            if constexpr (Policy::collisionLayers) {
+                const BodyRecord& member = compound.members[k];
+                if (!(world.layer[i] & member.mask) || !(member.layer & world.mask[i])) continue;
+            }
+            float approach = collideWithMember<Policy>(world, i, c, compound.members[k]);
+            if (approach > COMPOUND_SPLIT_SPEED) {
+                impacts.push_back({c, world.position(i)});
+            }
+        }
+    }
+    if (impacts.empty()) return;
+
+    for (const std::pair<int, Vec3>& impact : impacts) {
+        if (!compounds[impact.first].members.empty()) {
+            splitCompound(world, impact.first, impact.second);
+        }
+    }
+    compounds.erase(std::remove_if(compounds.begin(), compounds.end(),
+                                   [](const CompoundBody& compound) { return compound.members.empty(); }),
+                    compounds.end());
+    refreshCompoundProxies();
+}
+
+// Interleaves the bits of a 21-bit coordinate with two zero bits.
+uint64_t spreadBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// Keeps bodies in Morton order of REGION_SIZE regions, so bodies that are
+// close in space are close in memory and each region is a contiguous range.
+template <typename W>
+void sortByRegion(W& world) {
+    static std::vector<std::pair<uint64_t, int>> keys;
+    static std::vector<int> order;
+    keys.resize(world.count());
+    order.resize(world.count());
+
+    const int bias = 1 << 20;
+    for (int i = 0; i < world.count(); ++i) {
+        int rx = (int)std::floor(world.px[i] / REGION_SIZE) + bias;
+        int ry = (int)std::floor(world.py[i] / REGION_SIZE) + bias;
+        int rz = (int)std::floor(world.pz[i] / REGION_SIZE) + bias;
+        keys[i] = {spreadBits(rx) | spreadBits(ry) << 1 | spreadBits(rz) << 2, i};
+    }
+
+    if (std::is_sorted(keys.begin(), keys.end())) return;
+    std::sort(keys.begin(), keys.end());
+    for (int k = 0; k < world.count(); ++k) {
+        order[k] = keys[k].second;
+    }
+    world.reorder(order.data(), world.count());
+}
+
+// Once the awake bodies drift REBASE_DISTANCE from the float origin, shift
+// everything back by a whole number of regions and fold the shift into the
+// double-precision world origin.
+template <typename W>
+void recentreOrigin(W& world) {
+    double sumX = 0.0, sumZ = 0.0;
+    int awake = 0;
+    for (int i = 0; i < world.count(); ++i) {
+        if (world.resting[i]) continue;
+        sumX += world.px[i];
+        sumZ += world.pz[i];
+        awake++;
+    }
+    if (awake == 0) return;
+
+    double centreX = sumX / awake;
+    double centreZ = sumZ / awake;
+    if (std::fabs(centreX) < REBASE_DISTANCE && std::fabs(centreZ) < REBASE_DISTANCE) return;
+
+    float shiftX = (float)(std::round(centreX / REGION_SIZE) * REGION_SIZE);
+    float shiftZ = (float)(std::round(centreZ / REGION_SIZE) * REGION_SIZE);
+    for (int i = 0; i < world.count(); ++i) {
+        world.px[i] -= shiftX;
+        world.pz[i] -= shiftZ;
+    }
+    for (CompoundBody& compound : compounds) {
+        compound.shift(-shiftX, -shiftZ);
+    }
+    worldOriginX += shiftX;
+    worldOriginZ += shiftZ;
+
+    if (DEBUG_MODE) {
+        std::cout << "Rebased origin to (" << worldOriginX << ", " << worldOriginZ << ")" << std::endl;
+    }
+}
+
+// Regions whose bodies have all come to rest, with no awake body next to
+// them and far from the camera, are written to a memory-mapped temp file and
+// dropped from the world. They are read back when an awake body reaches a
+// neighbouring region or the camera comes within PAGE_IN_DISTANCE. All file
+// traffic happens on one I/O thread in request order, so a read queued after
+// a write always sees the written data.
+struct RegionPager {
+    struct PagedRegion {
+        unsigned long long offset;
+        unsigned long long bytes;
+        int count;
+        bool requested;
+    };
+
+    struct PageJob {
+        bool write;
+        int generation;
+        uint64_t key;
+        unsigned long long offset;
+        int count;
+        std::vector<BodyRecord> records;
+    };
+
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    HANDLE thread = NULL;
+    HANDLE wake = NULL;
+    CRITICAL_SECTION lock;
+    bool started = false;
+
+    // Guarded by lock.
+    std::vector<PageJob> queued;
+    std::vector<PageJob> completed;
+    bool stopping = false;
+
+    // Main thread only.
+    std::unordered_map<uint64_t, PagedRegion> paged;
+    std::vector<std::pair<unsigned long long, unsigned long long>> freeSlabs;
+    unsigned long long fileEnd = 0;
+    int generation = 0;
+    std::vector<uint64_t> wanted;
+    std::vector<int> keep;
+    std::vector<uint64_t> bodyRegion;
+
+    static uint64_t regionKey(long long rx, long long ry, long long rz) {
+        const long long bias = 1 << 20;
+        return (uint64_t)((rx + bias) & 0x1fffff) << 42 | (uint64_t)((ry + bias) & 0x1fffff) << 21 | (uint64_t)((rz + bias) & 0x1fffff);
+    }
+
+    static long long regionCoord(uint64_t key, int shift) { return (long long)((key >> shift) & 0x1fffff) - (1 << 20); }
+
+    // Local-frame corner of an absolute region; rebasing moves the origin by
+    // whole regions, so this is exact.
+    static Vec3 regionCorner(uint64_t key) {
+        long long originX = std::llround(worldOriginX / REGION_SIZE);
+        long long originZ = std::llround(worldOriginZ / REGION_SIZE);
+        return Vec3((float)(regionCoord(key, 42) - originX) * REGION_SIZE,
+                    (float)regionCoord(key, 21) * REGION_SIZE,
+                    (float)(regionCoord(key, 0) - originZ) * REGION_SIZE);
+    }
+
+    template <typename W>
+    static uint64_t regionOf(W& world, int i) {
+        return regionKey((long long)std::floor(world.px[i] / REGION_SIZE) + std::llround(worldOriginX / REGION_SIZE),
+                         (long long)std::floor(world.py[i] / REGION_SIZE),
+                         (long long)std::floor(world.pz[i] / REGION_SIZE) + std::llround(worldOriginZ / REGION_SIZE));
+    }
+
+    static DWORD WINAPI ioThread(LPVOID param) {
+        RegionPager* pager = (RegionPager*)param;
+        std::vector<PageJob> batch;
+        for (;;) {
+            WaitForSingleObject(pager->wake, INFINITE);
+
+            EnterCriticalSection(&pager->lock);
+            bool stop = pager->stopping;
+            batch.swap(pager->queued);
+            LeaveCriticalSection(&pager->lock);
+
+            for (PageJob& job : batch) {
+                pager->transfer(job);
+            }
+
+            EnterCriticalSection(&pager->lock);
+            for (PageJob& job : batch) {
+                if (!job.write) pager->completed.push_back(std::move(job));
+            }
+            LeaveCriticalSection(&pager->lock);
+            batch.clear();
+
+            if (stop) return 0;
+        }
+    }
+
+    void transfer(PageJob& job) {
+        size_t bytes = job.count * sizeof(BodyRecord);
+        void* view = MapViewOfFile(mapping, job.write ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                   (DWORD)(job.offset >> 32), (DWORD)job.offset, bytes);
+        if (!view) {
+            job.count = 0;
+            return;
+        }
+        if (job.write) {
+            memcpy(view, job.records.data(), bytes);
+            job.records.clear();
+        } else {
+            job.records.resize(job.count);
+            memcpy(job.records.data(), view, bytes);
+        }
+        UnmapViewOfFile(view);
+    }
+
+    bool start() {
+        started = true;
+
+        char directory[MAX_PATH];
+        char path[MAX_PATH];
+        GetTempPath(MAX_PATH, directory);
+        GetTempFileName(directory, "rgn", 0, path);
+        file = CreateFile(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        if (file != INVALID_HANDLE_VALUE) {
+            mapping = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD)(PAGE_FILE_BYTES >> 32), (DWORD)PAGE_FILE_BYTES, NULL);
+        }
+        if (!mapping) {
+            if (DEBUG_MODE) {
+                std::cout << "Region paging disabled: could not create the backing file." << std::endl;
+            }
+            return false;
+        }
+
+        InitializeCriticalSection(&lock);
+        wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        thread = CreateThread(NULL, 0, ioThread, this, 0, NULL);
+        return true;
+    }
+
+    void shutdown() {
+        if (!thread) return;
+        EnterCriticalSection(&lock);
+        stopping = true;
+        LeaveCriticalSection(&lock);
+        SetEvent(wake);
+        WaitForSingleObject(thread, INFINITE);
+
+        CloseHandle(thread);
+        CloseHandle(wake);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        DeleteCriticalSection(&lock);
+        thread = NULL;
+    }
+
+    void submit(PageJob&& job) {
+        EnterCriticalSection(&lock);
+        queued.push_back(std::move(job));
+        LeaveCriticalSection(&lock);
+        SetEvent(wake);
+    }
+
+    // Slabs are whole multiples of PAGE_SLAB_BYTES so every view offset meets
+    // the mapping's allocation granularity.
+    bool allocate(unsigned long long bytes, unsigned long long& offset) {
+        bytes = (bytes + PAGE_SLAB_BYTES - 1) / PAGE_SLAB_BYTES * PAGE_SLAB_BYTES;
+        for (size_t k = 0; k < freeSlabs.size(); ++k) {
+            if (freeSlabs[k].second == bytes) {
+                offset = freeSlabs[k].first;
+                freeSlabs.erase(freeSlabs.begin() + k);
+                return true;
+            }
+        }
+        if (fileEnd + bytes > PAGE_FILE_BYTES) return false;
+        offset = fileEnd;
+        fileEnd += bytes;
+        return true;
+    }
+
+    void release(unsigned long long offset, unsigned long long bytes) {
+        freeSlabs.push_back({offset, (bytes + PAGE_SLAB_BYTES - 1) / PAGE_SLAB_BYTES * PAGE_SLAB_BYTES});
+    }
+
+    // Regions written before a reset are forgotten; their slabs are reused.
+    void clear() {
+        for (auto& region : paged) {
+            release(region.second.offset, region.second.bytes);
+        }
+        paged.clear();
+        generation++;
+    }
+
+    template <typename W>
+    void pageIn(W& world) {
+        std::vector<PageJob> arrived;
+        EnterCriticalSection(&lock);
+        arrived.swap(completed);
+        LeaveCriticalSection(&lock);
+
+        for (PageJob& job : arrived) {
+            if (job.generation != generation) continue;
+            auto region = paged.find(job.key);
+            if (job.count == 0) {
+                region->second.requested = false;
+                continue;
+            }
+            release(region->second.offset, region->second.bytes);
+            paged.erase(region);
+
+            Vec3 corner = regionCorner(job.key);
+            for (const BodyRecord& record : job.records) {
+                world.resting[world.append(record, corner)] = true;
+            }
+
+            if (DEBUG_MODE) {
+                std::cout << "Paged in region with " << job.count << " bodies" << std::endl;
+            }
+        }
+    }
+
+    // Runs right after sortByRegion, so each region is a contiguous run.
+    template <typename W>
+    void pageOut(W& world) {
+        bodyRegion.resize(world.count());
+        for (int i = 0; i < world.count(); ++i) {
+            bodyRegion[i] = regionOf(world, i);
+        }
+
+        // Regions that must stay resident: around every awake body and
+        // around the camera, which looks at the local origin.
+        wanted.clear();
+        for (int i = 0; i < world.count(); ++i) {
+            if (world.resting[i] || (i > 0 && bodyRegion[i] == bodyRegion[i - 1] && !world.resting[i - 1])) continue;
+            long long rx = regionCoord(bodyRegion[i], 42), ry = regionCoord(bodyRegion[i], 21), rz = regionCoord(bodyRegion[i], 0);
+            for (int dx = -1; dx <= 1; ++dx)
+            for (int dy = -1; dy <= 1; ++dy)
+            for (int dz = -1; dz <= 1; ++dz) {
+                wanted.push_back(regionKey(rx + dx, ry + dy, rz + dz));
+            }
+        }
+        int reach = (int)std::ceil(PAGE_IN_DISTANCE / REGION_SIZE);
+        long long originX = std::llround(worldOriginX / REGION_SIZE);
+        long long originZ = std::llround(worldOriginZ / REGION_SIZE);
+        for (int dx = -reach; dx < reach; ++dx)
+        for (int dy = -reach; dy < reach; ++dy)
+        for (int dz = -reach; dz < reach; ++dz) {
+            wanted.push_back(regionKey(originX + dx, dy, originZ + dz));
+        }
+        std::sort(wanted.begin(), wanted.end());
+        wanted.erase(std::unique(wanted.begin(), wanted.end()), wanted.end());
+
+        for (uint64_t key : wanted) {
+            auto region = paged.find(key);
+            if (region == paged.end() || region->second.requested) continue;
+            region->second.requested = true;
+            submit({false, generation, key, region->second.offset, region->second.count, {}});
+        }
+
+        keep.clear();
+        int paged_out = 0;
+        for (int begin = 0; begin < world.count();) {
+            int end = begin;
+            bool asleep = true;
+            while (end < world.count() && bodyRegion[end] == bodyRegion[begin]) {
+                asleep = asleep && world.resting[end];
+                end++;
+            }
+
+            uint64_t key = bodyRegion[begin];
+            Vec3 centre = regionCorner(key) + Vec3(REGION_SIZE, REGION_SIZE, REGION_SIZE) * 0.5f;
+            unsigned long long offset = 0;
+            unsigned long long bytes = (end - begin) * sizeof(BodyRecord);
+            bool evict = asleep && centre.length() > PAGE_OUT_DISTANCE && paged.count(key) == 0
+                      && !std::binary_search(wanted.begin(), wanted.end(), key) && allocate(bytes, offset);
+
+            if (evict) {
+                PageJob job = {true, generation, key, offset, end - begin, {}};
+                Vec3 corner = regionCorner(key);
+                for (int i = begin; i < end; ++i) {
+                    job.records.push_back(world.record(i, corner));
+                }
+                paged[key] = {offset, bytes, end - begin, false};
+                submit(std::move(job));
+                paged_out += end - begin;
+            } else {
+                for (int i = begin; i < end; ++i) keep.push_back(i);
+            }
+            begin = end;
+        }
+
+        if (paged_out > 0) {
+            world.compact(keep);
+            if (DEBUG_MODE) {
+                std::cout << "Paged out " << paged_out << " bodies, " << world.count() << " resident, "
+                          << paged.size() << " regions on disk" << std::endl;
+            }
+        }
+    }
+};
+
+RegionPager regionPager;
+
+void clearRegionPaging() {
+    regionPager.clear();
+}
+
+void shutdownRegionPaging() {
+    regionPager.shutdown();
+}
+
+// Persistent worker threads for data-parallel loops. parallelFor hands out
+// chunks of [0, count) through an atomic counter; the calling thread takes
+// chunks too and returns once every worker has gone back to sleep.
+struct WorkerPool {
+    struct Worker {
+        HANDLE thread;
+        HANDLE wake;
+    };
+
+    std::vector<Worker> workers;
+    HANDLE done = NULL;
+    bool started = false;
+    std::atomic<bool> stopping{false};
+
+    void (*job)(void* context, int begin, int end) = nullptr;
+    void* context = nullptr;
+    int jobCount = 0;
+    int jobGrain = 1;
+    std::atomic<int> nextChunk{0};
+    std::atomic<int> busyWorkers{0};
+
+    void runChunks() {
+        for (;;) {
+            int begin = nextChunk.fetch_add(jobGrain);
+            if (begin >= jobCount) return;
+            job(context, begin, std::min(begin + jobGrain, jobCount));
+        }
+    }
+
+    static DWORD WINAPI workerThread(LPVOID param) {
+        std::pair<WorkerPool*, HANDLE>* start = (std::pair<WorkerPool*, HANDLE>*)param;
+        WorkerPool* pool = start->first;
+        HANDLE wake = start->second;
+        delete start;
+        for (;;) {
+            WaitForSingleObject(wake, INFINITE);
+            if (pool->stopping) return 0;
+            pool->runChunks();
+            if (pool->busyWorkers.fetch_sub(1) == 1) SetEvent(pool->done);
+        }
+    }
+
+    // WORKER_THREADS = 0 starts one worker per core beyond the caller's.
+    void start() {
+        started = true;
+        int threads = WORKER_THREADS;
+        if (threads <= 0) {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            threads = (int)info.dwNumberOfProcessors - 1;
+        }
+        threads = std::min(threads, MAX_WORKER_THREADS);
+        if (threads <= 0) return;
+
+        done = CreateEvent(NULL, FALSE, FALSE, NULL);
+        for (int k = 0; k < threads; ++k) {
+            Worker worker;
+            worker.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+            worker.thread = CreateThread(NULL, 0, workerThread, new std::pair<WorkerPool*, HANDLE>(this, worker.wake), 0, NULL);
+            workers.push_back(worker);
+        }
+        if (DEBUG_MODE) {
+            std::cout << "Worker pool: " << threads << " threads" << std::endl;
+        }
+    }
+
+    void shutdown() {
+        stopping = true;
+        for (Worker& worker : workers) {
+            SetEvent(worker.wake);
+            WaitForSingleObject(worker.thread, INFINITE);
+            CloseHandle(worker.thread);
+            CloseHandle(worker.wake);
+        }
+        if (done) CloseHandle(done);
+        workers.clear();
+        done = NULL;
+    }
+
+    template <typename Fn>
+    void parallelFor(int count, int grain, Fn fn) {
+        if (!started) start();
+        if (workers.empty() || count <= grain) {
+            if (count > 0) fn(0, count);
+            return;
+        }
+
+        job = [](void* context, int begin, int end) { (*(Fn*)context)(begin, end); };
+        context = &fn;
+        jobCount = count;
+        jobGrain = grain;
+        nextChunk = 0;
+        busyWorkers = (int)workers.size();
+        for (Worker& worker : workers) {
+            SetEvent(worker.wake);
+        }
+        runChunks();
+        WaitForSingleObject(done, INFINITE);
+    }
+};
+
+WorkerPool workerPool;
+
+void shutdownWorkers() {
+    workerPool.shutdown();
+}
+
+// Batch spatial queries over the world's bodies, answered from the tree the
+// tree broadphase uses. If the pair search built it this step it is only
+// refitted to the resolved positions, otherwise it is rebuilt, in both cases
+// at most once per step. Query q writes up to `capacity` body indices to
+// results[q * capacity ...] and its full hit count to counts[q], so a count
+// above capacity means the list was cut short. Batches are split across the
+// worker pool. Bodies held in compounds or paged out are not included.
+struct QueryBox {
+    Vec3 min, max;
+};
+
+struct QuerySphere {
+    Vec3 centre;
+    float radius;
+};
+
+struct SpatialIndex {
+    unsigned long long preparedStep = ~0ull;
+
+    template <typename W>
+    const BoxTree& prepare(W& world) {
+        BoxTree& tree = bodyTree.tree;
+        bool sameBodies = world.count() > 0 && (int)tree.centres.size() == world.count();
+        if (preparedStep == stepSerial && sameBodies) return tree;
+
+        auto centreAt = [&world](int i) { return world.position(i); };
+        auto sizeAt = [&world](int i) { return world.size[i]; };
+        if (bodyTree.builtStep == stepSerial && sameBodies) {
+            tree.refit(centreAt, sizeAt);
+        } else {
+            tree.build(world.count(), centreAt, sizeAt);
+        }
+        preparedStep = stepSerial;
+        return tree;
+    }
+};
+
+SpatialIndex spatialIndex;
+
+const int QUERY_GRAIN = 64;
+
+template <typename W>
+void queryBoxes(W& world, const QueryBox* boxes, int count, int* results, int capacity, int* counts) {
+    const BoxTree& tree = spatialIndex.prepare(world);
+    workerPool.parallelFor(count, QUERY_GRAIN, [&](int begin, int end) {
+        for (int q = begin; q < end; ++q) {
+            const QueryBox& box = boxes[q];
+            int* out = results + (size_t)q * capacity;
+            int found = 0;
+            tree.query(box.min.x, box.min.y, box.min.z, box.max.x, box.max.y, box.max.z, [&](int body) {
+                if (found < capacity) out[found] = body;
+                found++;
+            });
+            counts[q] = found;
+        }
+    });
+}
+
+// Bodies whose box comes within the sphere's radius of its centre.
+template <typename W>
+void querySpheres(W& world, const QuerySphere* spheres, int count, int* results, int capacity, int* counts) {
+    const BoxTree& tree = spatialIndex.prepare(world);
+    workerPool.parallelFor(count, QUERY_GRAIN, [&](int begin, int end) {
+        for (int q = begin; q < end; ++q) {
+            const Vec3& c = spheres[q].centre;
+            float r = spheres[q].radius;
+            int* out = results + (size_t)q * capacity;
+            int found = 0;
+            tree.query(c.x - r, c.y - r, c.z - r, c.x + r, c.y + r, c.z + r, [&](int body) {
+                float h = world.size[body] / 2.0f;
+                BoxTree::Node box = {world.px[body] - h, world.py[body] - h, world.pz[body] - h,
+                                     world.px[body] + h, world.py[body] + h, world.pz[body] + h, 0, 0, 0};
+                if (BoxTree::distanceSquared(box, c) > r * r) return;
+                if (found < capacity) out[found] = body;
+                found++;
+            });
+            counts[q] = found;
+        }
+    });
+}
+
+// The k bodies nearest to each point, closest first, into results and
+// distances at q * k; counts[q] is below k only when the world has fewer
+// bodies.
+template <typename W>
+void queryNearest(W& world, const Vec3* points, int count, int k, int* results, float* distances, int* counts) {
+    const BoxTree& tree = spatialIndex.prepare(world);
+    workerPool.parallelFor(count, QUERY_GRAIN, [&](int begin, int end) {
+        for (int q = begin; q < end; ++q) {
+            counts[q] = tree.nearest(points[q], k, results + (size_t)q * k, distances + (size_t)q * k);
+        }
+    });
+}
+
+// Directions are unit vectors, so distances are in metres. A miss reports
+// body -1 at maxDistance.
+struct Ray {
+    Vec3 origin;
+    Vec3 direction;
+    float maxDistance;
+};
+
+struct RayHit {
+    float distance;
+    int body;
+    Vec3 normal;
+};
+
+// First hit along each ray against the bodies' boxes, through the same tree
+// as the queries above. Rays are packed eight at a time in the order given,
+// so callers get the most from packet traversal by passing coherent rays
+// (one sensor's fan, one screen tile) next to each other. Packets live on
+// the stack and hits go straight to the caller's array, so nothing is
+// allocated per call once the tree is prepared.
+template <typename W>
+void castRays(W& world, const Ray* rays, int count, RayHit* hits) {
+    const BoxTree& tree = spatialIndex.prepare(world);
+    int packets = (count + RAY_PACKET - 1) / RAY_PACKET;
+    workerPool.parallelFor(packets, 16, [&](int begin, int end) {
+        RayPacket packet;
+        for (int p = begin; p < end; ++p) {
+            int first = p * RAY_PACKET;
+            int lanes = std::min(RAY_PACKET, count - first);
+            // Spare lanes repeat the last ray.
+            for (int k = 0; k < RAY_PACKET; ++k) {
+                const Ray& ray = rays[first + std::min(k, lanes - 1)];
+                auto inverse = [](float d) { return 1.0f / (std::fabs(d) > 1.0e-20f ? d : (d < 0.0f ? -1.0e-20f : 1.0e-20f)); };
+                packet.ox[k] = ray.origin.x;
+                packet.oy[k] = ray.origin.y;
+                packet.oz[k] = ray.origin.z;
+                packet.invX[k] = inverse(ray.direction.x);
+                packet.invY[k] = inverse(ray.direction.y);
+                packet.invZ[k] = inverse(ray.direction.z);
+                packet.tmax[k] = ray.maxDistance;
+                packet.body[k] = -1;
+            }
+            simd.castPacket(tree, packet);
+
+            // The face hit is the one the hit point lies furthest out on.
+            for (int k = 0; k < lanes; ++k) {
+                const Ray& ray = rays[first + k];
+                RayHit& hit = hits[first + k];
+                hit.distance = packet.tmax[k];
+                hit.body = packet.body[k];
+                hit.normal = Vec3(0.0f, 0.0f, 0.0f);
+                if (hit.body < 0) continue;
+                Vec3 offset = ray.origin + ray.direction * hit.distance - world.position(hit.body);
+                float ax = std::fabs(offset.x), ay = std::fabs(offset.y), az = std::fabs(offset.z);
+                if (ax >= ay && ax >= az) hit.normal.x = offset.x < 0.0f ? -1.0f : 1.0f;
+                else if (ay >= az) hit.normal.y = offset.y < 0.0f ? -1.0f : 1.0f;
+                else hit.normal.z = offset.z < 0.0f ? -1.0f : 1.0f;
+            }
+        }
+    });
+}
+
+// Barnes-Hut octree for mutual attraction. Bodies are sorted by Morton code,
+// so every node covers a contiguous run of them. The levels above
+// SPLIT_DEPTH are built first; the subtrees below them are built in parallel
+// and spliced in. The tree is walked once per leaf, opening a node unless
+// its cell is smaller than BARNES_HUT_THETA times its distance; accepted
+// nodes and the bodies of opened leaves form an interaction list that the
+// SIMD attract kernel then sums for each body of the leaf.
+struct AttractionOctree {
+    struct Node {
+        float comX, comY, comZ, mass;
+        float cx, cy, cz, half;
+        int firstChild, childCount;
+        int first, count;
+    };
+
+    static const int MAX_DEPTH = 10;
+    static const int SPLIT_DEPTH = 2;
+
+    std::vector<Node> nodes;
+    std::vector<uint64_t> keys;
+    std::vector<float> sx, sy, sz, sm;
+    std::vector<int> stubs;
+    std::vector<std::vector<Node>> subtrees;
+    std::vector<int> leaves;
+
+    int digitAt(int k, int depth) const { return (int)(keys[k] >> (32 + 3 * (MAX_DEPTH - 1 - depth))) & 7; }
+
+    // Children of a node are contiguous in `out`. With stopAtSplit, nodes at
+    // SPLIT_DEPTH are left unbuilt and recorded as stubs.
+    void buildNode(std::vector<Node>& out, int index, int first, int last, int depth, bool stopAtSplit) {
+        out[index].first = first;
+        out[index].count = last - first;
+        out[index].firstChild = -1;
+        out[index].childCount = 0;
+
+        if (last - first > OCTREE_LEAF_SIZE && depth < MAX_DEPTH) {
+            if (stopAtSplit && depth == SPLIT_DEPTH) {
+                stubs.push_back(index);
+                return;
+            }
+
+            int begins[9];
+            int k = first;
+            for (int digit = 0; digit < 8; ++digit) {
+                begins[digit] = k;
+                while (k < last && digitAt(k, depth) == digit) k++;
+            }
+            begins[8] = last;
+
+            int firstChild = (int)out.size();
+            int childCount = 0;
+            float quarter = out[index].half / 2.0f;
+            for (int digit = 0; digit < 8; ++digit) {
+                if (begins[digit] == begins[digit + 1]) continue;
+                Node child = {};
+                child.cx = out[index].cx + ((digit & 1) ? quarter : -quarter);
+                child.cy = out[index].cy + ((digit & 2) ? quarter : -quarter);
+                child.cz = out[index].cz + ((digit & 4) ? quarter : -quarter);
+                child.half = quarter;
+                out.push_back(child);
+                childCount++;
+            }
+            out[index].firstChild = firstChild;
+            out[index].childCount = childCount;
+
+            int child = firstChild;
+            for (int digit = 0; digit < 8; ++digit) {
+                if (begins[digit] == begins[digit + 1]) continue;
+                buildNode(out, child++, begins[digit], begins[digit + 1], depth + 1, stopAtSplit);
+            }
+        }
+        summarise(out, index);
+    }
+
+    void summarise(std::vector<Node>& out, int index) {
+        Node& n = out[index];
+        double mass = 0.0, x = 0.0, y = 0.0, z = 0.0;
+        if (n.childCount == 0) {
+            for (int k = n.first; k < n.first + n.count; ++k) {
+                mass += sm[k]; x += sm[k] * sx[k]; y += sm[k] * sy[k]; z += sm[k] * sz[k];
+            }
+        } else {
+            for (int c = n.firstChild; c < n.firstChild + n.childCount; ++c) {
+                const Node& child = out[c];
+                mass += child.mass; x += child.mass * child.comX; y += child.mass * child.comY; z += child.mass * child.comZ;
+            }
+        }
+        n.mass = (float)mass;
+        n.comX = mass > 0.0 ? (float)(x / mass) : n.cx;
+        n.comY = mass > 0.0 ? (float)(y / mass) : n.cy;
+        n.comZ = mass > 0.0 ? (float)(z / mass) : n.cz;
+    }
+
+    // Redoes the mass summaries of the levels built before the subtrees.
+    void summariseTop(int index, int depth) {
+        if (nodes[index].childCount == 0 || depth == SPLIT_DEPTH) return;
+        for (int c = nodes[index].firstChild; c < nodes[index].firstChild + nodes[index].childCount; ++c) {
+            summariseTop(c, depth + 1);
+        }
+        summarise(nodes, index);
+    }
+
+    template <typename W>
+    void build(W& world) {
+        int count = world.count();
+        float minX = PADDING_POSITION, minY = PADDING_POSITION, minZ = PADDING_POSITION;
+        float maxX = -PADDING_POSITION, maxY = -PADDING_POSITION, maxZ = -PADDING_POSITION;
+        for (int i = 0; i < count; ++i) {
+            minX = std::min(minX, world.px[i]); maxX = std::max(maxX, world.px[i]);
+            minY = std::min(minY, world.py[i]); maxY = std::max(maxY, world.py[i]);
+            minZ = std::min(minZ, world.pz[i]); maxZ = std::max(maxZ, world.pz[i]);
+        }
+        float half = std::max(std::max(maxX - minX, maxY - minY), maxZ - minZ) * 0.5f * 1.001f + 1e-3f;
+        float cx = (minX + maxX) * 0.5f, cy = (minY + maxY) * 0.5f, cz = (minZ + maxZ) * 0.5f;
+        float scale = 1024.0f / (2.0f * half);
+
+        keys.resize(count);
+        workerPool.parallelFor(count, 4096, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                uint64_t x = (uint64_t)std::min(1023.0f, (world.px[i] - (cx - half)) * scale);
+                uint64_t y = (uint64_t)std::min(1023.0f, (world.py[i] - (cy - half)) * scale);
+                uint64_t z = (uint64_t)std::min(1023.0f, (world.pz[i] - (cz - half)) * scale);
+                uint64_t code = spreadBits(x) | (spreadBits(y) << 1) | (spreadBits(z) << 2);
+                keys[i] = (code << 32) | (uint64_t)i;
+            }
+        });
+        std::sort(keys.begin(), keys.end());
+
+        for (auto* column : {&sx, &sy, &sz, &sm}) column->resize(count);
+        workerPool.parallelFor(count, 4096, [&](int begin, int end) {
+            for (int k = begin; k < end; ++k) {
+                int i = (int)(keys[k] & 0xffffffffu);
+                sx[k] = world.px[i]; sy[k] = world.py[i]; sz[k] = world.pz[i];
+                sm[k] = 1.0f / world.invMass[i];
+            }
+        });
+
+        Node root = {};
+        root.cx = cx; root.cy = cy; root.cz = cz; root.half = half;
+        nodes.assign(1, root);
+        stubs.clear();
+        buildNode(nodes, 0, 0, count, 0, true);
+
+        subtrees.resize(stubs.size());
+        workerPool.parallelFor((int)stubs.size(), 1, [&](int begin, int end) {
+            for (int s = begin; s < end; ++s) {
+                const Node& stub = nodes[stubs[s]];
+                subtrees[s].assign(1, stub);
+                buildNode(subtrees[s], 0, stub.first, stub.first + stub.count, SPLIT_DEPTH, false);
+            }
+        });
+
+        // A subtree's local node k > 0 lands at offset + k - 1.
+        for (size_t s = 0; s < stubs.size(); ++s) {
+            int offset = (int)nodes.size();
+            for (size_t k = 1; k < subtrees[s].size(); ++k) {
+                Node n = subtrees[s][k];
+                if (n.childCount > 0) n.firstChild += offset - 1;
+                nodes.push_back(n);
+            }
+            Node top = subtrees[s][0];
+            if (top.childCount > 0) top.firstChild += offset - 1;
+            nodes[stubs[s]] = top;
+        }
+        summariseTop(0, 0);
+
+        leaves.clear();
+        for (int k = 0; k < (int)nodes.size(); ++k) {
+            if (nodes[k].childCount == 0) leaves.push_back(k);
+        }
+    }
+
+    // Interaction list shared by every body of one leaf: the distance test
+    // is taken from the nearest point of the leaf's bounding sphere, so a
+    // node accepted for the leaf is accepted for each body in it.
+    void interactionsOf(const Node& leaf, std::vector<float>& lx, std::vector<float>& ly, std::vector<float>& lz, std::vector<float>& lm) const {
+        lx.clear(); ly.clear(); lz.clear(); lm.clear();
+        float theta2 = BARNES_HUT_THETA * BARNES_HUT_THETA;
+        float reach = 1.7320508f * leaf.half;
+
+        int stack[8 * MAX_DEPTH + 8];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& n = nodes[stack[--top]];
+            float dx = n.comX - leaf.cx, dy = n.comY - leaf.cy, dz = n.comZ - leaf.cz;
+            float distance = std::max(0.0f, std::sqrt(dx * dx + dy * dy + dz * dz) - reach);
+            float size = 2.0f * n.half;
+            if (n.childCount == 0) {
+                for (int b = n.first; b < n.first + n.count; ++b) {
+                    lx.push_back(sx[b]); ly.push_back(sy[b]); lz.push_back(sz[b]); lm.push_back(sm[b]);
+                }
+            } else if (size * size < theta2 * distance * distance) {
+                lx.push_back(n.comX); ly.push_back(n.comY); lz.push_back(n.comZ); lm.push_back(n.mass);
+            } else {
+                for (int c = n.firstChild; c < n.firstChild + n.childCount; ++c) stack[top++] = c;
+            }
+        }
+    }
+};
+
+AttractionOctree attractionOctree;
+
+// Mutual attraction between all bodies, as accelerations per body; the
+// integrators apply it alongside uniform gravity (AttractionField).
+template <typename W>
+void attractionAccelerations(W& world, float* ax, float* ay, float* az) {
+    if (world.count() < 2) return;
+    attractionOctree.build(world);
+
+    const AttractionOctree& tree = attractionOctree;
+    workerPool.parallelFor((int)tree.leaves.size(), 16, [&](int begin, int end) {
+        // Per-thread scratch, kept between evaluations; interactionsOf
+        // clears it, so it allocates only when a list outgrows it.
+        thread_local std::vector<float> lx, ly, lz, lm;
+        for (int l = begin; l < end; ++l) {
+            const AttractionOctree::Node& leaf = tree.nodes[tree.leaves[l]];
+            tree.interactionsOf(leaf, lx, ly, lz, lm);
+            for (int k = leaf.first; k < leaf.first + leaf.count; ++k) {
+                // The body's own entry sits at zero distance and adds nothing.
+                float acceleration[3] = {0.0f, 0.0f, 0.0f};
+                simd.attract(lx.data(), ly.data(), lz.data(), lm.data(), (int)lx.size(), tree.sx[k], tree.sy[k], tree.sz[k], ATTRACTION_SOFTENING, acceleration);
+                int i = (int)(tree.keys[k] & 0xffffffffu);
+                ax[i] = acceleration[0] * ATTRACTION_STRENGTH;
+                ay[i] = acceleration[1] * ATTRACTION_STRENGTH;
+                az[i] = acceleration[2] * ATTRACTION_STRENGTH;
+            }
+        }
+    });
+}
+
+// Uniform grid over the particles' bounding box, rebuilt by counting sort.
+// After build(), order lists the particles cell by cell, with x the
+// fastest-varying cell axis, so once the particles are permuted into that
+// order the three cells of a row are one contiguous slot range. Cells are
+// at least `range` wide and are widened when the particles are spread so
+// thinly that the grid would hold many more cells than particles.
+struct ParticleCellGrid {
+    float range = 1.0f;
+    float invCellSize = 1.0f;
+    float minX = 0.0f, minY = 0.0f, minZ = 0.0f;
+    int nx = 1, ny = 1, nz = 1;
+    std::vector<int> cellStart;
+    std::vector<int> cellOf;
+    std::vector<int> order;
+
+    static const int MAX_CELLS_PER_PARTICLE = 4;
+
+    void configure(float interactionRange) { range = interactionRange; }
+
+    void fit(const float* x, const float* y, const float* z, int count) {
+        float x0 = PADDING_POSITION, y0 = PADDING_POSITION, z0 = PADDING_POSITION;
+        float x1 = -PADDING_POSITION, y1 = -PADDING_POSITION, z1 = -PADDING_POSITION;
+        for (int i = 0; i < count; ++i) {
+            x0 = std::min(x0, x[i]); x1 = std::max(x1, x[i]);
+            y0 = std::min(y0, y[i]); y1 = std::max(y1, y[i]);
+            z0 = std::min(z0, z[i]); z1 = std::max(z1, z[i]);
+        }
+        float volume = (x1 - x0 + range) * (y1 - y0 + range) * (z1 - z0 + range);
+        float cellSize = std::max(range, std::cbrt(volume / ((float)MAX_CELLS_PER_PARTICLE * std::max(count, 1))));
+        invCellSize = 1.0f / cellSize;
+        minX = x0; minY = y0; minZ = z0;
+        nx = (int)((x1 - x0) * invCellSize) + 1;
+        ny = (int)((y1 - y0) * invCellSize) + 1;
+        nz = (int)((z1 - z0) * invCellSize) + 1;
+    }
+
+    int clampCell(float v, float origin, int cells) const {
+        return std::min(std::max((int)((v - origin) * invCellSize), 0), cells - 1);
+    }
+
+    void cellOfPoint(float x, float y, float z, int& cx, int& cy, int& cz) const {
+        cx = clampCell(x, minX, nx);
+        cy = clampCell(y, minY, ny);
+        cz = clampCell(z, minZ, nz);
+    }
+
+    int cellIndex(int cx, int cy, int cz) const { return cx + nx * (cy + ny * cz); }
+
+    void build(const float* x, const float* y, const float* z, int count) {
+        fit(x, y, z, count);
+        cellStart.assign((size_t)nx * ny * nz + 1, 0);
+        cellOf.resize(count);
+        order.resize(count);
+        workerPool.parallelFor(count, 8192, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                int cx, cy, cz;
+                cellOfPoint(x[i], y[i], z[i], cx, cy, cz);
+                cellOf[i] = cellIndex(cx, cy, cz);
+            }
+        });
+        for (int i = 0; i < count; ++i) cellStart[cellOf[i] + 1]++;
+        for (size_t c = 1; c < cellStart.size(); ++c) cellStart[c] += cellStart[c - 1];
+        for (int i = 0; i < count; ++i) order[cellStart[cellOf[i]]++] = i;
+        // The scatter advanced each start to the next cell's; shift back.
+        for (size_t c = cellStart.size() - 1; c > 0; --c) cellStart[c] = cellStart[c - 1];
+        cellStart[0] = 0;
+    }
 
-                    PostQuitMessage(0);
-                    break;
+    // Calls visit(first, last) for each row of cells the box covers; points
+    // outside the grid fall in its border cells.
+    template <typename Visit>
+    void forRowsInBox(float x0, float y0, float z0, float x1, float y1, float z1, Visit visit) const {
+        int ax, ay, az, bx, by, bz;
+        cellOfPoint(x0, y0, z0, ax, ay, az);
+        cellOfPoint(x1, y1, z1, bx, by, bz);
+        for (int cz = az; cz <= bz; ++cz) {
+            for (int cy = ay; cy <= by; ++cy) {
+                visit(cellStart[cellIndex(ax, cy, cz)], cellStart[cellIndex(bx, cy, cz) + 1]);
+            }
+        }
+    }
 
+    // Calls visit(first, last) for the slot range of each neighbouring row.
+    template <typename Visit>
+    void forNeighbourRows(float x, float y, float z, Visit visit) const {
+        int cx, cy, cz;
+        cellOfPoint(x, y, z, cx, cy, cz);
+        int x0 = std::max(cx - 1, 0), x1 = std::min(cx + 1, nx - 1);
+        for (int dz = -1; dz <= 1; ++dz) {
+            if (cz + dz < 0 || cz + dz >= nz) continue;
+            for (int dy = -1; dy <= 1; ++dy) {
+                if (cy + dy < 0 || cy + dy >= ny) continue;
+                visit(cellStart[cellIndex(x0, cy + dy, cz + dz)], cellStart[cellIndex(x1, cy + dy, cz + dz) + 1]);
             }
-            break;
+        }
+    }
+};
 
-        case WM_CLOSE:
-            PostQuitMessage(0);
-            break;
+// Discrete-element granular material: equal spheres with spring-dashpot
+// contacts against each other, the ground and the arena walls, stepped with
+// symplectic Euler in GRANULAR_SUBSTEPS substeps so the springs stay stiff.
+// Particles are kept in cell order, so neighbour rows are contiguous.
+struct GranularMedium {
+    std::vector<float> x, y, z;
+    std::vector<float> vx, vy, vz;
+    std::vector<float> ax, ay, az;
+    int particles = 0;
+    ParticleCellGrid grid;
+
+    ParticleColumns columns() const { return {x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data()}; }
+
+    // A loose block of particles dropped into the arena.
+    void reset() {
+        int count = GRANULAR_PARTICLES;
+        for (auto* column : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az}) column->assign(count + PARTICLE_PADDING, 0.0f);
+        particles = count;
+
+        float spacing = GRANULAR_RADIUS * 2.2f;
+        int side = std::max(1, (int)std::cbrt((float)count));
+        std::uniform_real_distribution<float> jitter(-0.05f * GRANULAR_RADIUS, 0.05f * GRANULAR_RADIUS);
+        for (int i = 0; i < count; ++i) {
+            x[i] = (i % side - side / 2) * spacing + jitter(rng);
+            z[i] = (i / side % side - side / 2) * spacing + jitter(rng);
+            y[i] = GROUND_Y + 2.0f + (i / (side * side)) * spacing;
+        }
 
-        case WM_DESTROY:
-            PostQuitMessage(0);
-            break;
+        grid.configure(2.0f * GRANULAR_RADIUS);
+    }
 
-        default:
-            return DefWindowProc(hWnd, message, wParam, lParam);
+    void sortByCell() {
+        grid.build(x.data(), y.data(), z.data(), particles);
+        for (auto* column : {&x, &y, &z, &vx, &vy, &vz}) {
+            permuteColumn(*column, grid.order.data(), particles);
+        }
     }
-    return 0;
-}
 
-void EnableOpenGL(HWND hWnd, HDC* hDC, HGLRC* hRC) {
-    PIXELFORMATDESCRIPTOR pfd;
-    int iFormat;
+    void computeAccelerations() {
+        const SpringContact spring = {2.0f * GRANULAR_RADIUS, GRANULAR_STIFFNESS, GRANULAR_DAMPING, GRANULAR_TANGENTIAL_DAMPING};
+        const ParticleColumns p = {x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data()};
+        const float bound = ArenaWalls::bound;
+        workerPool.parallelFor(particles, 1024, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                float self[6] = {x[i], y[i], z[i], vx[i], vy[i], vz[i]};
+                float a[3] = {0.0f, -GRAVITY, 0.0f};
+                grid.forNeighbourRows(x[i], y[i], z[i], [&](int first, int last) {
+                    simd.springContacts(p, first, last, self, spring, a);
+                });
+
+                // Ground and walls as springs along their normals.
+                float ground = GRANULAR_RADIUS - (y[i] - GROUND_Y);
+                if (ground > 0.0f) a[1] += std::max(GRANULAR_STIFFNESS * ground - GRANULAR_DAMPING * vy[i], 0.0f);
+                float minX = GRANULAR_RADIUS - (x[i] + bound), maxX = GRANULAR_RADIUS - (bound - x[i]);
+                float minZ = GRANULAR_RADIUS - (z[i] + bound), maxZ = GRANULAR_RADIUS - (bound - z[i]);
+                if (minX > 0.0f) a[0] += std::max(GRANULAR_STIFFNESS * minX - GRANULAR_DAMPING * vx[i], 0.0f);
+                if (maxX > 0.0f) a[0] -= std::max(GRANULAR_STIFFNESS * maxX + GRANULAR_DAMPING * vx[i], 0.0f);
+                if (minZ > 0.0f) a[2] += std::max(GRANULAR_STIFFNESS * minZ - GRANULAR_DAMPING * vz[i], 0.0f);
+                if (maxZ > 0.0f) a[2] -= std::max(GRANULAR_STIFFNESS * maxZ + GRANULAR_DAMPING * vz[i], 0.0f);
+
+                ax[i] = a[0]; ay[i] = a[1]; az[i] = a[2];
+            }
+        });
+    }
 
-    *hDC = GetDC(hWnd);
+    void step(float deltaTime) {
+        if (particles == 0) return;
+        float dt = deltaTime / GRANULAR_SUBSTEPS;
+        for (int substep = 0; substep < GRANULAR_SUBSTEPS; ++substep) {
+            sortByCell();
+            computeAccelerations();
+            workerPool.parallelFor(particles, 8192, [&](int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    vx[i] += ax[i] * dt; vy[i] += ay[i] * dt; vz[i] += az[i] * dt;
+                    x[i] += vx[i] * dt; y[i] += vy[i] * dt; z[i] += vz[i] * dt;
+                }
+            });
+        }
+    }
+};
 
-    ZeroMemory(&pfd, sizeof(pfd));
-    pfd.nSize = sizeof(pfd);
-    pfd.nVersion = 1;
-    pfd.dwFlags = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
-    pfd.iPixelType = PFD_TYPE_RGBA;
-    pfd.cColorBits = 24;
-    pfd.cDepthBits = 16;
-    pfd.iLayerType = PFD_MAIN_PLANE;
+GranularMedium granularMedium;
 
-    iFormat = ChoosePixelFormat(*hDC, &pfd);
-    SetPixelFormat(*hDC, iFormat, &pfd);
+void resetGranular() {
+    if (GRANULAR_MODE) granularMedium.reset();
+}
 
-    *hRC = wglCreateContext(*hDC);
-    wglMakeCurrent(*hDC, *hRC);
+void drawParticles(const std::vector<float>& x, const std::vector<float>& y, const std::vector<float>& z, int count,
+                   float red, float green, float blue) {
+    if (count == 0) return;
+    static std::vector<float> points;
+    points.resize(count * 3);
+    for (int i = 0; i < count; ++i) {
+        points[3 * i] = x[i];
+        points[3 * i + 1] = y[i];
+        points[3 * i + 2] = z[i];
+    }
 
-    wglSwapIntervalEXT = (PFNWGLSWAPINTERVALEXTPROC)wglGetProcAddress("wglSwapIntervalEXT");
+    glDisable(GL_LIGHTING);
+    glPointSize(2.0f);
+    glColor3f(red, green, blue);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, points.data());
+    glDrawArrays(GL_POINTS, 0, (GLsizei)count);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glEnable(GL_LIGHTING);
+}
 
-    if (wglSwapIntervalEXT) {
+void drawGranular() {
+    drawParticles(granularMedium.x, granularMedium.y, granularMedium.z, granularMedium.particles, 0.85f, 0.7f, 0.4f);
+}
 
-        if (DEBUG_MODE) {
-            wglSwapIntervalEXT(0); 
-            std::cout << "V-Sync disabled (DEBUG_MODE is true)." << std::endl;
-        } else {
-            wglSwapIntervalEXT(1); 
-            std::cout << "V-Sync enabled (DEBUG_MODE is false)." << std::endl;
+// Weakly compressible SPH: density from the poly6 kernel, pressure from a
+// linear equation of state with sound speed FLUID_SOUND_SPEED, and spiky
+// pressure and Laplacian viscosity forces, in FLUID_SUBSTEPS symplectic Euler
+// substeps. It shares the granular mode's cell grid and particle layout.
+// Cubes are coupled by pushing particles out of their boxes and giving each
+// cube the opposite impulse, so the fluid carries and buoys them.
+struct FluidVolume {
+    std::vector<float> x, y, z;
+    std::vector<float> vx, vy, vz;
+    std::vector<float> ax, ay, az;
+    std::vector<float> pressure, invDensity;
+    int particles = 0;
+    float mass = 0.0f;
+    SphKernel kernel = {};
+    float densityScale = 0.0f;
+    ParticleCellGrid grid;
+
+    // A column of water standing in one corner of the arena, dam-break style.
+    void reset() {
+        int count = FLUID_PARTICLES;
+        for (auto* column : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &pressure, &invDensity}) {
+            column->assign(count + PARTICLE_PADDING, 0.0f);
         }
-    } else {
-        if (DEBUG_MODE) { 
-            std::cout << "Could not control V-Sync (wglSwapIntervalEXT not found or not supported)." << std::endl;
+        particles = count;
+
+        float h = 2.0f * FLUID_SPACING;
+        mass = FLUID_REST_DENSITY * FLUID_SPACING * FLUID_SPACING * FLUID_SPACING;
+        densityScale = mass * 315.0f / (64.0f * (float)M_PI * std::pow(h, 9.0f));
+        float gradient = 45.0f / ((float)M_PI * std::pow(h, 6.0f));
+        kernel = {h, mass * gradient, FLUID_VISCOSITY * mass * gradient};
+
+        int side = std::max(1, (int)std::cbrt(count / 2.0f));
+        float corner = -ArenaWalls::bound + FLUID_SPACING;
+        for (int i = 0; i < count; ++i) {
+            x[i] = corner + (i % side) * FLUID_SPACING;
+            z[i] = corner + (i / side % side) * FLUID_SPACING;
+            y[i] = GROUND_Y + FLUID_SPACING * (0.5f + i / (side * side));
         }
-    }
-}
 
-void DisableOpenGL(HWND hWnd, HDC hDC, HGLRC hRC) {
-    wglMakeCurrent(NULL, NULL);
-    wglDeleteContext(hRC);
-    ReleaseDC(hWnd, hDC);
-}
+        grid.configure(h);
+    }
 
-void initOpenGL() {
+    void sortByCell() {
+        grid.build(x.data(), y.data(), z.data(), particles);
+        for (auto* column : {&x, &y, &z, &vx, &vy, &vz}) {
+            permuteColumn(*column, grid.order.data(), particles);
+        }
+    }
 
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    if (DEBUG_MODE) { 
-        std::cout << "Sky color set to black at initialization." << std::endl;
+    // Particles inside a cube's box are moved to its nearest face, and the
+    // normal velocity they had into the face is shared out as an impulse
+    // between particle and cube. Impulses apply one particle at a time, so
+    // later particles see the cube already slowed.
+    template <typename W>
+    void pushCubes(W& world) {
+        float radius = 0.5f * FLUID_SPACING;
+        float invParticleMass = 1.0f / mass;
+        for (int k = 0; k < world.count(); ++k) {
+            float reach = world.size[k] / 2.0f + radius;
+            float centre[3] = {world.px[k], world.py[k], world.pz[k]};
+            float cubeVelocity[3] = {world.vx[k], world.vy[k], world.vz[k]};
+            float invMass = world.invMass[k];
+            grid.forRowsInBox(centre[0] - reach, centre[1] - reach, centre[2] - reach,
+                              centre[0] + reach, centre[1] + reach, centre[2] + reach, [&](int first, int last) {
+                for (int j = first; j < last; ++j) {
+                    float* position[3] = {&x[j], &y[j], &z[j]};
+                    float* velocity[3] = {&vx[j], &vy[j], &vz[j]};
+                    float d[3], depth[3];
+                    for (int a = 0; a < 3; ++a) {
+                        d[a] = *position[a] - centre[a];
+                        depth[a] = reach - std::fabs(d[a]);
+                    }
+                    if (depth[0] <= 0.0f || depth[1] <= 0.0f || depth[2] <= 0.0f) continue;
+                    int axis = depth[0] < depth[1] ? (depth[0] < depth[2] ? 0 : 2) : (depth[1] < depth[2] ? 1 : 2);
+                    float sign = d[axis] < 0.0f ? -1.0f : 1.0f;
+                    *position[axis] = centre[axis] + sign * reach;
+                    float vn = (*velocity[axis] - cubeVelocity[axis]) * sign;
+                    if (vn >= 0.0f) continue;
+                    float impulse = -vn / (invParticleMass + invMass);
+                    *velocity[axis] += sign * impulse * invParticleMass;
+                    cubeVelocity[axis] -= sign * impulse * invMass;
+                }
+            });
+            world.vx[k] = cubeVelocity[0];
+            world.vy[k] = cubeVelocity[1];
+            world.vz[k] = cubeVelocity[2];
+        }
     }
 
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);
+    void computeDensities() {
+        const ParticleColumns p = {x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data()};
+        workerPool.parallelFor(particles, 1024, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                float self[3] = {x[i], y[i], z[i]};
+                float sum = 0.0f;
+                grid.forNeighbourRows(x[i], y[i], z[i], [&](int first, int last) {
+                    simd.sphDensity(p, first, last, self, kernel.radius, &sum);
+                });
+                float density = densityScale * sum;
+                float excess = std::max(density - FLUID_REST_DENSITY, 0.0f);
+                invDensity[i] = 1.0f / density;
+                pressure[i] = FLUID_SOUND_SPEED * FLUID_SOUND_SPEED * excess * invDensity[i] * invDensity[i];
+            }
+        });
+    }
 
-    GLfloat light_position[] = {1.0f, 1.0f, 1.0f, 0.0f};
-    GLfloat light_ambient[] = {0.2f, 0.2f, 0.2f, 1.0f};
-    GLfloat light_diffuse[] = {0.8f, 0.8f, 0.8f, 1.0f};
-    GLfloat light_specular[] = {1.0f, 1.0f, 1.0f, 1.0f};
+    void computeAccelerations() {
+        const FluidColumns f = {{x.data(), y.data(), z.data(), vx.data(), vy.data(), vz.data()}, pressure.data(), invDensity.data()};
+        workerPool.parallelFor(particles, 1024, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                float self[8] = {x[i], y[i], z[i], vx[i], vy[i], vz[i], pressure[i], invDensity[i]};
+                float a[3] = {0.0f, -GRAVITY, 0.0f};
+                grid.forNeighbourRows(x[i], y[i], z[i], [&](int first, int last) {
+                    simd.sphForces(f, first, last, self, kernel, a);
+                });
+                ax[i] = a[0]; ay[i] = a[1]; az[i] = a[2];
+            }
+        });
+    }
 
-    glLightfv(GL_LIGHT0, GL_POSITION, light_position);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, light_ambient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
-    glLightfv(GL_LIGHT0, GL_SPECULAR, light_specular);
+    // The ground and walls stop motion into them and leave the rest.
+    template <typename Walls>
+    void integrate(float dt) {
+        float radius = 0.5f * FLUID_SPACING;
+        float floor = GROUND_Y + radius, side = Walls::bound - radius;
+        workerPool.parallelFor(particles, 8192, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                vx[i] += ax[i] * dt; vy[i] += ay[i] * dt; vz[i] += az[i] * dt;
+                x[i] += vx[i] * dt; y[i] += vy[i] * dt; z[i] += vz[i] * dt;
+                if (y[i] < floor) { y[i] = floor; vy[i] = std::max(vy[i], 0.0f); }
+                if constexpr (Walls::sides) {
+                    if (x[i] < -side) { x[i] = -side; vx[i] = std::max(vx[i], 0.0f); }
+                    if (x[i] > side) { x[i] = side; vx[i] = std::min(vx[i], 0.0f); }
+                    if (z[i] < -side) { z[i] = -side; vz[i] = std::max(vz[i], 0.0f); }
+                    if (z[i] > side) { z[i] = side; vz[i] = std::min(vz[i], 0.0f); }
+                }
+            }
+        });
+    }
 
-    glEnable(GL_COLOR_MATERIAL);
-    glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
-    glShadeModel(GL_SMOOTH);
+    template <typename Walls, typename W>
+    void step(W& world, float deltaTime) {
+        if (particles == 0) return;
+        float dt = deltaTime / FLUID_SUBSTEPS;
+        for (int substep = 0; substep < FLUID_SUBSTEPS; ++substep) {
+            sortByCell();
+            pushCubes(world);
+            computeDensities();
+            computeAccelerations();
+            integrate<Walls>(dt);
+        }
+    }
+};
 
-    RECT rect;
-    GetClientRect(g_hWnd, &rect);
-    reshape(rect.right - rect.left, rect.bottom - rect.top);
+FluidVolume fluidVolume;
 
-    resetCubes(); 
+void resetFluid() {
+    if (FLUID_MODE) fluidVolume.reset();
 }
 
-void resetCubes() {
-    cubes.clear();
-
-    for (int i = 0; i < NUM_CUBES; ++i) {
-        Cube newCube;
-        newCube.size = CUBE_SIZE;
-        newCube.velocity = Vec3(0.0f, 0.0f, 0.0f);
-        newCube.angularVelocity = Vec3(0.0f, 0.0f, 0.0f);
-        newCube.rotation = Vec3(0.0f, 0.0f, 0.0f);
-        newCube.resting = false;
+void drawFluid() {
+    drawParticles(fluidVolume.x, fluidVolume.y, fluidVolume.z, fluidVolume.particles, 0.2f, 0.45f, 0.9f);
+}
 
-        float x_offset = (i % 10 - 5.0f) * (CUBE_SIZE * 2.0f);
-        float z_offset = ((i / 10) % 10 - 5.0f) * (CUBE_SIZE * 2.0f);
-        float y_offset = (i / 100) * (CUBE_SIZE * 2.0f) + dist_height(rng);
+// splitmix64; integer-only, so every replica draws the same sequence.
+struct LockstepRng {
+    uint64_t state;
 
-        newCube.position = Vec3(x_offset, y_offset, z_offset);
+    uint32_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return (uint32_t)((z ^ (z >> 31)) >> 32);
+    }
 
-        cubes.push_back(newCube);
+    // Uniform in [low, high).
+    Fixed range(Fixed low, Fixed high) {
+        return low + (Fixed)(((uint64_t)next() * (uint32_t)(high - low)) >> 32);
     }
-    secondTimer = 0.0f;
-    secondsCount = 0;
-    fpsTimer = 0.0f;
-    frameCount = 0;
-    resetTimer = 0.0f;
-}
+};
 
-void updatePhysics(float deltaTime) {
-    secondTimer += deltaTime;
-    if (secondTimer >= 1.0f) {
-        secondsCount++;
-        if (DEBUG_MODE) { 
-            std::cout << "Seconds: " << secondsCount << std::endl;
+// Right shifts of negative values are arithmetic on every compiler we build
+// with, and integer division truncates towards zero by the standard.
+inline Fixed fixedMul(Fixed a, Fixed b) { return (Fixed)(((int64_t)a * b) >> FIXED_SHIFT); }
+
+inline uint32_t isqrt64(uint64_t x) {
+    uint64_t root = 0, bit = 1ull << 62;
+    while (bit > x) bit >>= 2;
+    while (bit) {
+        if (x >= root + bit) {
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        } else {
+            root >>= 1;
         }
-        secondTimer = 0.0f;
+        bit >>= 2;
     }
+    return (uint32_t)root;
+}
 
-    resetTimer += deltaTime;
-    if (resetTimer >= RESET_INTERVAL_SECONDS) {
-        if (DEBUG_MODE) { 
-            std::cout << "Resetting cubes due to timer." << std::endl;
-        }
-        resetCubes();
+// The cube scene in Q16.16 for lockstep replicas: the same seed and tick
+// count give bit-identical state on any compiler, ISA or thread count, so
+// only inputs have to be exchanged. It ticks at FIXED_TICK_RATE, resets on
+// its own tick count rather than the frame timer, and follows the float
+// step's wall and pair rules for linear motion. Spin is cosmetic here: a
+// random kick on body contacts, kept as wrapping binary angles (2^32 per
+// turn) plus a rate, and read only when drawing.
+struct LockstepWorld {
+    static constexpr Fixed gravity = toFixed((double)GRAVITY / ((double)FIXED_TICK_RATE * FIXED_TICK_RATE));
+    static constexpr Fixed groundY = toFixed(GROUND_Y);
+    static constexpr Fixed bound = toFixed(ArenaWalls::bound);
+    static constexpr Fixed bounce = toFixed(BOUNCE_FACTOR);
+    static constexpr Fixed friction = toFixed(FRICTION_FACTOR);
+    static constexpr Fixed restSpeed = toFixed((double)REST_THRESHOLD / FIXED_TICK_RATE);
+    static constexpr Fixed restHeight = toFixed(REST_THRESHOLD);
+    static constexpr Fixed separation = toFixed(0.001);
+    static constexpr Fixed slotSpacing = toFixed(CUBE_SIZE * 2.0);
+    static constexpr int32_t impactSpin = (int32_t)(4294967296.0 / 2.0 / FIXED_TICK_RATE);
+    static constexpr uint32_t resetTicks = (uint32_t)(RESET_INTERVAL_SECONDS * FIXED_TICK_RATE);
+
+    std::vector<Fixed> px, py, pz;
+    std::vector<Fixed> vx, vy, vz;
+    std::vector<Fixed> half;
+    std::vector<int64_t> mass;
+    std::vector<uint32_t> angleX, angleY, angleZ;
+    std::vector<int32_t> spinX, spinY, spinZ;
+    std::vector<uint32_t> spinTick;
+    std::vector<unsigned char> flags;
+    std::vector<unsigned char> resting;
+    int bodies = 0;
+    uint32_t tick = 0;
+    uint64_t seed = 0;
+    uint64_t scene = 0;
+    LockstepRng random = {0};
+    float pendingTicks = 0.0f;
+
+    FixedColumnPointers pointers() {
+        return {px.data(), py.data(), pz.data(), vx.data(), vy.data(), vz.data(), half.data()};
     }
 
-    rotateY += AUTO_ROTATE_SPEED_Y * deltaTime;
-    rotateY = fmod(rotateY, 360.0f); 
+    void start(uint64_t startSeed) {
+        seed = startSeed;
+        scene = 0;
+        pendingTicks = 0.0f;
+        reset();
+    }
 
-    for (int i = 0; i < NUM_CUBES; ++i) {
-        Cube& cube = cubes[i];
+    void reset() {
+        int capacity = tileRoundUp(NUM_CUBES);
+        for (auto* column : {&px, &py, &pz, &vx, &vy, &vz, &half, &spinX, &spinY, &spinZ}) column->assign(capacity, 0);
+        for (auto* column : {&angleX, &angleY, &angleZ, &spinTick}) column->assign(capacity, 0u);
+        mass.assign(capacity, 0);
+        flags.assign(capacity, 0);
+        resting.assign(capacity, 0);
+        bodies = NUM_CUBES;
+        tick = 0;
+        random.state = seed + scene;
+
+        const Fixed minHalf = toFixed(MIN_CUBE_SIZE / 2.0), maxHalf = toFixed(MAX_CUBE_SIZE / 2.0);
+        for (int i = 0; i < bodies; ++i) {
+            half[i] = minHalf < maxHalf ? random.range(minHalf, maxHalf) : minHalf;
+            mass[i] = ((int64_t)half[i] * half[i] >> FIXED_SHIFT) * half[i];
+            px[i] = (i % 10 - 5) * slotSpacing;
+            py[i] = (i / 100) * slotSpacing + random.range(toFixed(5.0), toFixed(15.0));
+            pz[i] = ((i / 10) % 10 - 5) * slotSpacing;
+        }
+        for (int i = bodies; i < capacity; ++i) {
+            px[i] = py[i] = pz[i] = FIXED_PADDING;
+        }
+    }
 
-        cube.velocity.y -= GRAVITY * deltaTime;
+    // Runs the ticks the elapsed time covers. A lockstep host calls step()
+    // once per tick it has every replica's inputs for instead.
+    void advance(float deltaTime) {
+        pendingTicks += deltaTime * FIXED_TICK_RATE;
+        while (pendingTicks >= 1.0f) {
+            step();
+            pendingTicks -= 1.0f;
+        }
+    }
 
-        cube.position.x += cube.velocity.x * deltaTime;
-        cube.position.y += cube.velocity.y * deltaTime;
-        cube.position.z += cube.velocity.z * deltaTime;
+    void step() {
+        FixedColumnPointers c = pointers();
+        simd.integrateFixed(c, bodies, gravity);
+        simd.wallFlagsFixed(c, bodies, groundY, bound, flags.data());
+        for (int i = 0; i < bodies; ++i) {
+            collideWalls(i);
+        }
+        collidePairs();
 
-        cube.rotation.x += cube.angularVelocity.x * deltaTime;
-        cube.rotation.y += cube.angularVelocity.y * deltaTime;
-        cube.rotation.z += cube.angularVelocity.z * deltaTime;
+        if (++tick >= resetTicks) {
+            ++scene;
+            reset();
+        }
+    }
 
-        cube.rotation.x = fmod(cube.rotation.x, 360.0f);
-        cube.rotation.y = fmod(cube.rotation.y, 360.0f);
-        cube.rotation.z = fmod(cube.rotation.z, 360.0f);
+    // Restitution along the normal (sign gives its direction), the rebound
+    // tilted by a random perturbation that keeps its speed, then friction on
+    // the sliding components.
+    void bounceOffPlane(Fixed& normal, Fixed& tangent1, Fixed& tangent2, int sign) {
+        Fixed speed = normal * sign;
+        if (speed < 0) {
+            Fixed rebound = fixedMul(-speed, bounce);
+            Fixed p1 = random.range(-FIXED_ONE / 2, FIXED_ONE / 2);
+            Fixed p2 = random.range(-FIXED_ONE / 2, FIXED_ONE / 2);
+            int64_t length = isqrt64((1ull << (2 * FIXED_SHIFT)) + (uint64_t)((int64_t)p1 * p1 + (int64_t)p2 * p2));
+            normal = sign * (Fixed)(((int64_t)rebound << FIXED_SHIFT) / length);
+            tangent1 += (Fixed)((int64_t)rebound * p1 / length);
+            tangent2 += (Fixed)((int64_t)rebound * p2 / length);
+        }
+        tangent1 = fixedMul(tangent1, friction);
+        tangent2 = fixedMul(tangent2, friction);
+    }
 
-        float halfSize = cube.size / 2.0f;
-        float cube_bottom = cube.position.y - halfSize;
+    void collideWalls(int i) {
+        Fixed bottom = py[i] - half[i];
+        unsigned char f = flags[i];
 
-        if (cube_bottom < GROUND_Y) {
-            cube.position.y = GROUND_Y + halfSize;
+        if (f & WALL_GROUND) {
+            py[i] = groundY + half[i];
+            bounceOffPlane(vy[i], vx[i], vz[i], 1);
+        }
+        if (f & WALL_MIN_X) {
+            px[i] = -bound + half[i];
+            bounceOffPlane(vx[i], vy[i], vz[i], 1);
+        } else if (f & WALL_MAX_X) {
+            px[i] = bound - half[i];
+            bounceOffPlane(vx[i], vy[i], vz[i], -1);
+        }
+        if (f & WALL_MIN_Z) {
+            pz[i] = -bound + half[i];
+            bounceOffPlane(vz[i], vx[i], vy[i], 1);
+        } else if (f & WALL_MAX_Z) {
+            pz[i] = bound - half[i];
+            bounceOffPlane(vz[i], vx[i], vy[i], -1);
+        }
 
-            Vec3 normal = Vec3(0.0f, 1.0f, 0.0f);
-            Vec3 random_perturb = Vec3(dist_bounce_angle(rng), 0.0f, dist_bounce_angle(rng));
-            Vec3 bounce_direction = (normal + random_perturb).normalize();
+        int64_t speed2 = (int64_t)vx[i] * vx[i] + (int64_t)vy[i] * vy[i] + (int64_t)vz[i] * vz[i];
+        resting[i] = speed2 < (int64_t)restSpeed * restSpeed && bottom <= groundY + restHeight;
+        if (resting[i]) {
+            vx[i] = vy[i] = vz[i] = 0;
+            setSpin(i, 0, 0, 0);
+        }
+    }
 
-            float normal_speed = cube.velocity.dot(normal);
-            Vec3 new_normal_velocity = bounce_direction * (-normal_speed * BOUNCE_FACTOR);
+    // Folds the turn made since the last change into the base angles.
+    void setSpin(int i, int32_t x, int32_t y, int32_t z) {
+        uint32_t elapsed = tick - spinTick[i];
+        angleX[i] += (uint32_t)spinX[i] * elapsed;
+        angleY[i] += (uint32_t)spinY[i] * elapsed;
+        angleZ[i] += (uint32_t)spinZ[i] * elapsed;
+        spinX[i] = x; spinY[i] = y; spinZ[i] = z;
+        spinTick[i] = tick;
+    }
 
-            Vec3 tangential_velocity = cube.velocity - (normal * normal_speed);
-            tangential_velocity = tangential_velocity * FRICTION_FACTOR;
+    void kickSpin(int i) {
+        int32_t x = random.range(-impactSpin, impactSpin);
+        int32_t y = random.range(-impactSpin, impactSpin);
+        int32_t z = random.range(-impactSpin, impactSpin);
+        setSpin(i, x, y, z);
+    }
 
-            cube.velocity = new_normal_velocity + tangential_velocity;
+    // boxContact and applyContact without the rotational terms: separate
+    // along the axis of least overlap, exchange the approaching speed with
+    // restitution by mass share, and cut the relative slip by friction.
+    void resolvePair(int i, int j) {
+        Fixed* p[3] = {px.data(), py.data(), pz.data()};
+        Fixed* v[3] = {vx.data(), vy.data(), vz.data()};
+        Fixed overlap[3];
+        for (int a = 0; a < 3; ++a) {
+            overlap[a] = std::min(p[a][i] + half[i], p[a][j] + half[j]) - std::max(p[a][i] - half[i], p[a][j] - half[j]);
+        }
+        int axis = (overlap[0] < overlap[1] && overlap[0] < overlap[2]) ? 0
+                 : (overlap[1] < overlap[0] && overlap[1] < overlap[2]) ? 1 : 2;
+        int sign = p[axis][i] > p[axis][j] ? 1 : -1;
+
+        Fixed push = overlap[axis] / 2 + separation;
+        p[axis][i] += sign * push;
+        p[axis][j] -= sign * push;
+
+        Fixed approach = (v[axis][i] - v[axis][j]) * sign;
+        if (approach >= 0) return;
+
+        Fixed share1 = (Fixed)((mass[j] << FIXED_SHIFT) / (mass[i] + mass[j]));
+        Fixed share2 = FIXED_ONE - share1;
+        Fixed change = fixedMul(approach, FIXED_ONE + bounce);
+        v[axis][i] -= sign * fixedMul(change, share1);
+        v[axis][j] += sign * fixedMul(change, share2);
+        for (int a = 0; a < 3; ++a) {
+            if (a == axis) continue;
+            Fixed cut = fixedMul(v[a][i] - v[a][j], FIXED_ONE - friction);
+            v[a][i] -= fixedMul(cut, share1);
+            v[a][j] += fixedMul(cut, share2);
+        }
+        kickSpin(i);
+        kickSpin(j);
+    }
 
-            if (std::abs(normal_speed) > REST_THRESHOLD) {
-                cube.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
+    // Same tile walk as collidePairsTiled, so pairs resolve in a fixed order.
+    void collidePairs() {
+        FixedColumnPointers c = pointers();
+        for (int i = 0; i < bodies; ++i) {
+            int j = i + 1;
+            while (j < bodies) {
+                int base = j - j % PAIR_TILE;
+                unsigned mask = simd.overlapTileFixed(c, i, base) & (~0u << (j - base));
+                if (mask == 0) {
+                    j = base + PAIR_TILE;
+                    continue;
+                }
+                int k = __builtin_ctz(mask);
+                resolvePair(i, base + k);
+                j = base + k + 1;
             }
         }
+    }
 
-        float bound = 8.0f;
-        if (cube.position.x - halfSize < -bound) {
-            cube.position.x = -bound + halfSize;
-            Vec3 normal = Vec3(1.0f, 0.0f, 0.0f);
-            Vec3 random_perturb = Vec3(0.0f, dist_bounce_angle(rng), dist_bounce_angle(rng));
-            Vec3 bounce_direction = (normal + random_perturb).normalize();
-
-            float normal_speed = cube.velocity.dot(normal);
-            Vec3 new_normal_velocity = bounce_direction * (-normal_speed * BOUNCE_FACTOR);
-            Vec3 tangential_velocity = cube.velocity - (normal * normal_speed);
-            tangential_velocity = tangential_velocity * FRICTION_FACTOR;
-            cube.velocity = new_normal_velocity + tangential_velocity;
-
-            if (std::abs(normal_speed) > REST_THRESHOLD) {
-                cube.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
+    // FNV-1a over the simulated state, for replicas to compare.
+    uint64_t stateHash() const {
+        uint64_t hash = 0xcbf29ce484222325ull;
+        auto mix = [&](const std::vector<Fixed>& column) {
+            for (int i = 0; i < bodies; ++i) {
+                uint32_t word = (uint32_t)column[i];
+                for (int b = 0; b < 4; ++b) {
+                    hash = (hash ^ ((word >> (8 * b)) & 0xff)) * 0x100000001b3ull;
+                }
             }
-        } else if (cube.position.x + halfSize > bound) {
-            cube.position.x = bound - halfSize;
-            Vec3 normal = Vec3(-1.0f, 0.0f, 0.0f);
-            Vec3 random_perturb = Vec3(0.0f, dist_bounce_angle(rng), dist_bounce_angle(rng));
-            Vec3 bounce_direction = (normal + random_perturb).normalize();
+        };
+        for (const auto* column : {&px, &py, &pz, &vx, &vy, &vz, &half}) mix(*column);
+        return hash ^ tick;
+    }
+};
 
-            float normal_speed = cube.velocity.dot(normal);
-            Vec3 new_normal_velocity = bounce_direction * (-normal_speed * BOUNCE_FACTOR);
-            Vec3 tangential_velocity = cube.velocity - (normal * normal_speed);
-            tangential_velocity = tangential_velocity * FRICTION_FACTOR;
-            cube.velocity = new_normal_velocity + tangential_velocity;
+LockstepWorld lockstepWorld;
 
-            if (std::abs(normal_speed) > REST_THRESHOLD) {
-                cube.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
-            }
-        }
+void resetLockstep() {
+    if (FIXED_POINT_MODE) lockstepWorld.start(FIXED_POINT_SEED);
+}
 
-        if (cube.position.z - halfSize < -bound) {
-            cube.position.z = -bound + halfSize;
-            Vec3 normal = Vec3(0.0f, 0.0f, 1.0f);
-            Vec3 random_perturb = Vec3(dist_bounce_angle(rng), dist_bounce_angle(rng), 0.0f);
-            Vec3 bounce_direction = (normal + random_perturb).normalize();
+void drawLockstep() {
+    const LockstepWorld& w = lockstepWorld;
+    const float unit = 1.0f / FIXED_ONE;
+    const float radiansPerTurn = 2.0f * 3.14159265f / 4294967296.0f;
+    Matrix4 transform;
+    for (int i = 0; i < w.bodies; ++i) {
+        uint32_t elapsed = w.tick - w.spinTick[i];
+        float x = (float)(int32_t)(w.angleX[i] + (uint32_t)w.spinX[i] * elapsed) * radiansPerTurn;
+        float y = (float)(int32_t)(w.angleY[i] + (uint32_t)w.spinY[i] * elapsed) * radiansPerTurn;
+        float z = (float)(int32_t)(w.angleZ[i] + (uint32_t)w.spinZ[i] * elapsed) * radiansPerTurn;
+        Quat q = Quat::fromSpin(Vec3(0.0f, 0.0f, z), 1.0f) * Quat::fromSpin(Vec3(0.0f, y, 0.0f), 1.0f) * Quat::fromSpin(Vec3(x, 0.0f, 0.0f), 1.0f);
+        writeTransform(transform, w.px[i] * unit, w.py[i] * unit, w.pz[i] * unit, q.w, q.x, q.y, q.z, w.half[i] * unit);
+        drawCube(transform);
+    }
+}
 
-            float normal_speed = cube.velocity.dot(normal);
-            Vec3 new_normal_velocity = bounce_direction * (-normal_speed * BOUNCE_FACTOR);
-            Vec3 tangential_velocity = cube.velocity - (normal * normal_speed);
-            tangential_velocity = tangential_velocity * FRICTION_FACTOR;
-            cube.velocity = new_normal_velocity + tangential_velocity;
+// Scratch for projectSubstep, kept between steps so it allocates only when
+// the scene grows. Each pair stores its correction as normal * depth and the
+// share of it each body takes; bodyPairs lists every body's pairs (CSR, by
+// pairStart) with the sign of its share folded into the entry's low bit.
+struct PositionSolver {
+    std::vector<float> prevX, prevY, prevZ;
+    std::vector<float> predictedX, predictedY, predictedZ;
+    std::vector<float> incomingX, incomingY, incomingZ;
+    std::vector<std::pair<int, int>> tiledPairs;
+    std::vector<float> pairX, pairY, pairZ;
+    std::vector<float> shareI, shareJ;
+    std::vector<int> pairStart, bodyPairs;
+};
 
-            if (std::abs(normal_speed) > REST_THRESHOLD) {
-                cube.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
-            }
-        } else if (cube.position.z + halfSize > bound) {
-            cube.position.z = bound - halfSize;
-            Vec3 normal = Vec3(0.0f, 0.0f, -1.0f);
-            Vec3 random_perturb = Vec3(dist_bounce_angle(rng), dist_bounce_angle(rng), 0.0f);
-            Vec3 bounce_direction = (normal + random_perturb).normalize();
+PositionSolver positionSolver;
+
+// Candidate pairs for the position solver, found once per substep from the
+// predicted positions by the policy's broadphase; the adaptive one falls
+// back to its size rule since the solver does not time the strategies.
+template <typename Policy, typename W>
+const std::vector<std::pair<int, int>>& findSolverPairs(W& world) {
+    constexpr bool grid = std::is_same<typename Policy::Broadphase, HierarchicalGridBroadphase>::value;
+    constexpr bool adaptive = std::is_same<typename Policy::Broadphase, AdaptiveBroadphase>::value;
+    if (grid || (adaptive && world.count() > ADAPT_TILED_MAX_BODIES)) {
+        hierarchicalGrid.findPairs<Policy::collisionLayers>(world);
+        return hierarchicalGrid.pairs;
+    }
+    collectPairsTiled<Policy>(world, positionSolver.tiledPairs);
+    return positionSolver.tiledPairs;
+}
 
-            float normal_speed = cube.velocity.dot(normal);
-            Vec3 new_normal_velocity = bounce_direction * (-normal_speed * BOUNCE_FACTOR);
-            Vec3 tangential_velocity = cube.velocity - (normal * normal_speed);
-            tangential_velocity = tangential_velocity * FRICTION_FACTOR;
-            cube.velocity = new_normal_velocity + tangential_velocity;
+// Moves body i out of the ground and walls.
+template <typename Walls, typename W>
+void projectWalls(W& world, int i) {
+    float h = world.size[i] / 2.0f;
+    if constexpr (Walls::ground) world.py[i] = std::max(world.py[i], GROUND_Y + h);
+    if constexpr (Walls::sides) {
+        world.px[i] = std::min(std::max(world.px[i], -Walls::bound + h), Walls::bound - h);
+        world.pz[i] = std::min(std::max(world.pz[i], -Walls::bound + h), Walls::bound - h);
+    }
+}
 
-            if (std::abs(normal_speed) > REST_THRESHOLD) {
-                cube.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
-            }
+// One position-based substep: positions are predicted by the integrator,
+// then PBD_ITERATIONS Jacobi sweeps project the contacts and walls. A sweep
+// first computes every pair's correction from the same positions, then moves
+// each body by the average of its corrections times PBD_RELAXATION, so both
+// halves split into independent work items. Velocities are the distance
+// moved over the substep; the ground and walls then restore the restitution
+// share of the normal speed a body hit them with and take the friction share
+// of its sliding. Overlap already present at the start (fresh scenes, split
+// compounds) is removed first by PBD_STABILIZATION_ITERATIONS sweeps over
+// the old positions, which shift old and predicted positions alike so the
+// separation does not turn into velocity.
+template <typename Policy, typename W>
+void projectSubstep(W& world, float deltaTime) {
+    using Walls = typename Policy::Walls;
+    PositionSolver& solver = positionSolver;
+    int count = world.count();
+
+    for (auto* column : {&solver.prevX, &solver.prevY, &solver.prevZ}) column->resize(count);
+    std::copy(world.px.begin(), world.px.begin() + count, solver.prevX.begin());
+    std::copy(world.py.begin(), world.py.begin() + count, solver.prevY.begin());
+    std::copy(world.pz.begin(), world.pz.begin() + count, solver.prevZ.begin());
+    Policy::Integrator::integrate(world, deltaTime);
+    for (auto* column : {&solver.predictedX, &solver.predictedY, &solver.predictedZ, &solver.incomingX, &solver.incomingY, &solver.incomingZ}) {
+        column->resize(count);
+    }
+    std::copy(world.px.begin(), world.px.begin() + count, solver.predictedX.begin());
+    std::copy(world.py.begin(), world.py.begin() + count, solver.predictedY.begin());
+    std::copy(world.pz.begin(), world.pz.begin() + count, solver.predictedZ.begin());
+
+    const std::vector<std::pair<int, int>>& pairs = findSolverPairs<Policy>(world);
+    int pairCount = (int)pairs.size();
+    for (auto* column : {&solver.pairX, &solver.pairY, &solver.pairZ, &solver.shareI, &solver.shareJ}) column->resize(pairCount);
+
+    solver.pairStart.assign(count + 1, 0);
+    for (const std::pair<int, int>& pair : pairs) {
+        solver.pairStart[pair.first + 1]++;
+        solver.pairStart[pair.second + 1]++;
+    }
+    for (int i = 0; i < count; ++i) solver.pairStart[i + 1] += solver.pairStart[i];
+    solver.bodyPairs.resize(2 * pairCount);
+    {
+        std::vector<int> fill(solver.pairStart.begin(), solver.pairStart.end() - 1);
+        for (int p = 0; p < pairCount; ++p) {
+            solver.bodyPairs[fill[pairs[p].first]++] = 2 * p;
+            solver.bodyPairs[fill[pairs[p].second]++] = 2 * p + 1;
         }
+    }
 
-        if (cube.velocity.length() < REST_THRESHOLD && cube.angularVelocity.length() < REST_THRESHOLD * 10 && (cube_bottom <= GROUND_Y + REST_THRESHOLD)) {
-            cube.resting = true;
-            cube.velocity = Vec3(0.0f, 0.0f, 0.0f);
-            cube.angularVelocity = Vec3(0.0f, 0.0f, 0.0f);
-        } else {
-            cube.resting = false;
+    // Only the main sweeps report contacts. Their impulse is what moving
+    // the pair apart by the correction over one substep takes.
+    auto sweep = [&](bool report) {
+        workerPool.parallelFor(pairCount, 256, [&](int begin, int end) {
+            CubeColumnPointers columns = world.pointers();
+            for (int p = begin; p < end; ++p) {
+                int i = pairs[p].first, j = pairs[p].second;
+                float weight = world.invMass[i] + world.invMass[j];
+                solver.shareI[p] = solver.shareJ[p] = 0.0f;
+                if (weight <= 0.0f || !cubesOverlap(columns, i, j)) continue;
+
+                Contact contact;
+                if constexpr (Policy::mixedShapes) {
+                    if (!ShapeTestTable<W>::table[world.shape[i]][world.shape[j]](world, i, j, contact)) continue;
+                } else {
+                    contact = boxContact(world.position(i), world.size[i] / 2.0f, world.position(j), world.size[j] / 2.0f);
+                }
+                solver.pairX[p] = contact.normal.x * contact.depth;
+                solver.pairY[p] = contact.normal.y * contact.depth;
+                solver.pairZ[p] = contact.normal.z * contact.depth;
+                solver.shareI[p] = world.invMass[i] / weight;
+                solver.shareJ[p] = -world.invMass[j] / weight;
+                if constexpr (Policy::contactEvents) {
+                    if (report) contactStream.record(i, j, 0, contact.depth / (weight * deltaTime), contact.point);
+                }
+            }
+        });
+
+        workerPool.parallelFor(count, 256, [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                float dx = 0.0f, dy = 0.0f, dz = 0.0f;
+                int active = 0;
+                for (int k = solver.pairStart[i]; k < solver.pairStart[i + 1]; ++k) {
+                    int p = solver.bodyPairs[k] >> 1;
+                    float share = (solver.bodyPairs[k] & 1) ? solver.shareJ[p] : solver.shareI[p];
+                    if (share == 0.0f) continue;
+                    dx += solver.pairX[p] * share;
+                    dy += solver.pairY[p] * share;
+                    dz += solver.pairZ[p] * share;
+                    active++;
+                }
+                if (active > 0) {
+                    float scale = PBD_RELAXATION / active;
+                    world.px[i] += dx * scale;
+                    world.py[i] += dy * scale;
+                    world.pz[i] += dz * scale;
+                }
+                projectWalls<Walls>(world, i);
+            }
+        });
+    };
+
+    std::copy(solver.prevX.begin(), solver.prevX.end(), world.px.begin());
+    std::copy(solver.prevY.begin(), solver.prevY.end(), world.py.begin());
+    std::copy(solver.prevZ.begin(), solver.prevZ.end(), world.pz.begin());
+    for (int iteration = 0; iteration < PBD_STABILIZATION_ITERATIONS; ++iteration) sweep(false);
+    for (int i = 0; i < count; ++i) {
+        solver.predictedX[i] += world.px[i] - solver.prevX[i];
+        solver.predictedY[i] += world.py[i] - solver.prevY[i];
+        solver.predictedZ[i] += world.pz[i] - solver.prevZ[i];
+        solver.prevX[i] = world.px[i];
+        solver.prevY[i] = world.py[i];
+        solver.prevZ[i] = world.pz[i];
+    }
+    std::copy(solver.predictedX.begin(), solver.predictedX.end(), world.px.begin());
+    std::copy(solver.predictedY.begin(), solver.predictedY.end(), world.py.begin());
+    std::copy(solver.predictedZ.begin(), solver.predictedZ.end(), world.pz.begin());
+
+    for (int iteration = 0; iteration < PBD_ITERATIONS; ++iteration) sweep(true);
+
+    float invDt = 1.0f / deltaTime;
+    workerPool.parallelFor(count, 256, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            // The integrator left the predicted velocity in place.
+            solver.incomingX[i] = world.vx[i];
+            solver.incomingY[i] = world.vy[i];
+            solver.incomingZ[i] = world.vz[i];
+            world.setVelocity(i, Vec3((world.px[i] - solver.prevX[i]) * invDt,
+                                      (world.py[i] - solver.prevY[i]) * invDt,
+                                      (world.pz[i] - solver.prevZ[i]) * invDt));
+        }
+    });
+
+    // Bodies projectWalls moved sit exactly on the plane it put them on. This
+    // pass stays serial because the rebound scatter draws from rng.
+    for (int i = 0; i < count; ++i) {
+        float h = world.size[i] / 2.0f;
+        Vec3 velocity = world.velocity(i);
+        bool moved = false;
+        auto rebound = [&](const Vec3& normal, float incoming, unsigned char surface) {
+            float speed = -Policy::Restitution::at(-incoming) * incoming;
+            velocity = velocity - normal * velocity.dot(normal) + bounceDirection<Policy>(normal) * speed;
+            moved = true;
+            if constexpr (Policy::contactEvents) {
+                float impulse = world.invMass[i] > 0.0f ? (speed - incoming) / world.invMass[i] : 0.0f;
+                contactStream.record(i, -1, surface, impulse, world.position(i) - normal * h);
+            }
+        };
+        if (Walls::ground && world.py[i] != solver.predictedY[i] && world.py[i] == GROUND_Y + h && solver.incomingY[i] < 0.0f) {
+            float keep = 1.0f - Policy::Friction::slipReduction(std::sqrt(velocity.x * velocity.x + velocity.z * velocity.z));
+            velocity.x *= keep;
+            velocity.z *= keep;
+            rebound(Vec3(0.0f, 1.0f, 0.0f), solver.incomingY[i], WALL_GROUND);
+        }
+        if (Walls::sides && world.px[i] != solver.predictedX[i] && std::fabs(world.px[i]) == Walls::bound - h
+            && solver.incomingX[i] * world.px[i] > 0.0f) {
+            float side = world.px[i] > 0.0f ? -1.0f : 1.0f;
+            rebound(Vec3(side, 0.0f, 0.0f), solver.incomingX[i] * side, side > 0.0f ? WALL_MIN_X : WALL_MAX_X);
         }
+        if (Walls::sides && world.pz[i] != solver.predictedZ[i] && std::fabs(world.pz[i]) == Walls::bound - h
+            && solver.incomingZ[i] * world.pz[i] > 0.0f) {
+            float side = world.pz[i] > 0.0f ? -1.0f : 1.0f;
+            rebound(Vec3(0.0f, 0.0f, side), solver.incomingZ[i] * side, side > 0.0f ? WALL_MIN_Z : WALL_MAX_Z);
+        }
+        if (moved) world.setVelocity(i, velocity);
     }
+}
 
-    for (int i = 0; i < NUM_CUBES; ++i) {
-        for (int j = i + 1; j < NUM_CUBES; ++j) {
-            Cube& cube1 = cubes[i];
-            Cube& cube2 = cubes[j];
+// Position-based dynamics in place of the impulse pair loop. Jacobi sweeps
+// carry a correction one body further through a stack per sweep, so
+// PBD_SUBSTEPS short substeps settle stacks far better than the same sweeps
+// spent on one long step. Bounces off the walls are not randomised, and spin
+// is left as it is, since contacts between the axis-aligned boxes cannot
+// turn them.
+template <typename Policy, typename W>
+void solvePositions(W& world, float deltaTime) {
+    static_assert(!Policy::multiRate && !Policy::timeBudget, "the position solver steps every body every step");
+    for (int substep = 0; substep < PBD_SUBSTEPS; ++substep) {
+        projectSubstep<Policy>(world, deltaTime / PBD_SUBSTEPS);
+    }
+    for (int i = 0; i < world.count(); ++i) {
+        updateResting(world, i, world.py[i] - world.size[i] / 2.0f, deltaTime);
+    }
+}
 
-            float c1_minX = cube1.position.x - cube1.size / 2.0f;
-            float c1_maxX = cube1.position.x + cube1.size / 2.0f;
-            float c1_minY = cube1.position.y - cube1.size / 2.0f;
+// A body at rate level L moves only on every 2^L-th step, by the time it
+// has accumulated since it last moved; in between its step length is zero.
+template <typename W>
+void scheduleRates(W& world, float deltaTime) {
+    stepIndex++;
+    for (int i = 0; i < world.count(); ++i) {
+        world.pendingDt[i] += deltaTime;
+        world.due[i] = (stepIndex & ((1u << world.rateLevel[i]) - 1)) == 0;
+        world.stepDt[i] = world.due[i] ? world.pendingDt[i] : 0.0f;
+        if (world.due[i]) world.pendingDt[i] = 0.0f;
+    }
+}
 
-            float c1_maxY = cube1.position.y + cube1.size / 2.0f;
-            float c1_minZ = cube1.position.z - cube1.size / 2.0f;
-            float c1_maxZ = cube1.position.z + cube1.size / 2.0f;
+// After a body moves, it gets the slowest rate at which one of its steps
+// still travels less than MULTI_RATE_MAX_TRAVEL and stops short of the
+// ground: a long step into a contact would be snapped back out, which adds
+// energy. For the same reason a body touching anything stays at the base
+// rate unless it is resting.
+template <typename W>
+void updateRates(W& world, float deltaTime) {
+    for (int i = 0; i < world.count(); ++i) {
+        if (!world.due[i]) continue;
+        if (world.wallFlags[i] != 0 && !world.resting[i]) {
+            world.rateLevel[i] = 0;
+            continue;
+        }
+        float speed = world.velocity(i).length();
+        float gravity = world.resting[i] ? 0.0f : 0.5f * GRAVITY;
+        float clearance = world.resting[i] ? MULTI_RATE_MAX_TRAVEL : world.py[i] - world.size[i] / 2.0f - GROUND_Y;
+        int level = 0;
+        while (level < MAX_RATE_LEVEL) {
+            float dt = deltaTime * (float)(2 << level);
+            float travel = speed * dt + gravity * dt * dt;
+            if (travel >= MULTI_RATE_MAX_TRAVEL || travel >= clearance) break;
+            level++;
+        }
+        world.rateLevel[i] = level;
+    }
+}
 
-            float c2_minX = cube2.position.x - cube2.size / 2.0f;
+template <typename Policy, typename W>
+void stepWorld(W& world, float deltaTime) {
+    // Only the budgeted step reads the clock; the budget covers the whole step.
+    std::chrono::steady_clock::time_point deadline;
+    if constexpr (Policy::timeBudget) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::microseconds((long long)(STEP_BUDGET_MS * 1000.0f));
+    }
 
-            float c2_maxX = cube2.position.x + cube2.size / 2.0f;
+    if constexpr (Policy::rebaseOrigin) {
+        recentreOrigin(world);
+    }
+    if constexpr (Policy::pageRegions && !W::fixedCapacity) {
+        if (!regionPager.started) regionPager.start();
+        if (regionPager.thread) regionPager.pageIn(world);
+    }
+    if constexpr (Policy::regionLayout) {
+        if (++stepsSinceRegionSort >= REGION_SORT_INTERVAL) {
+            sortByRegion(world);
+            stepsSinceRegionSort = 0;
+            if constexpr (Policy::pageRegions && !W::fixedCapacity) {
+                if (regionPager.thread) regionPager.pageOut(world);
+            }
+        }
+    }
 
-            float c2_minY = cube2.position.y - cube2.size / 2.0f;
+    if constexpr (Policy::granular) {
+        granularMedium.step(deltaTime);
+    }
+    if constexpr (Policy::fluid) {
+        fluidVolume.step<typename Policy::Walls>(world, deltaTime);
+    }
 
-            float c2_maxY = cube2.position.y + cube2.size / 2.0f;
+    if constexpr (std::is_same<typename Policy::Solver, PositionBasedSolver>::value) {
+        solvePositions<Policy>(world, deltaTime);
+    } else {
+        if constexpr (Policy::multiRate) {
+            scheduleRates(world, deltaTime);
+            Policy::Integrator::integrate(world, world.stepDt.data());
+        } else {
+            Policy::Integrator::integrate(world, deltaTime);
+        }
 
-            float c2_minZ = cube2.position.z - cube2.size / 2.0f;
+        collideWalls<Policy>(world, deltaTime);
 
-            float c2_maxZ = cube2.position.z + cube2.size / 2.0f;
+        if constexpr (Policy::timeBudget) {
+            collidePairsBudgeted<Policy>(world, deadline);
+        } else {
+            collidePairs<Policy>(world);
+        }
+    }
 
-            bool overlapX = (c1_maxX > c2_minX && c1_minX < c2_maxX);
-            bool overlapY = (c1_maxY > c2_minY && c1_minY < c2_maxY);
-            bool overlapZ = (c1_maxZ > c2_minZ && c1_minZ < c2_maxZ);
+    if constexpr (Policy::consolidatePiles && !W::fixedCapacity) {
+        collideCompounds<Policy>(world);
+        if (++stepsSinceConsolidation >= CONSOLIDATE_INTERVAL) {
+            consolidatePiles<Policy>(world);
+            stepsSinceConsolidation = 0;
+        }
+    }
 
-            if (overlapX && overlapY && overlapZ) {
-                float overlap_x = std::min(c1_maxX, c2_maxX) - std::max(c1_minX, c2_minX);
-                float overlap_y = std::min(c1_maxY, c2_maxY) - std::max(c1_minY, c2_minY);
-                float overlap_z = std::min(c1_maxZ, c2_maxZ) - std::max(c1_minZ, c2_minZ);
+    if constexpr (Policy::settle) {
+        dampBodies<Policy>(world, deltaTime);
+        trackSettling<Policy>(world);
+    }
 
-                Vec3 mtv_direction;
-                float mtv_magnitude = 0.0f;
+    if constexpr (Policy::multiRate) {
+        updateRates(world, deltaTime);
+    }
 
-                if (overlap_x < overlap_y && overlap_x < overlap_z) {
-                    mtv_magnitude = overlap_x;
-                    mtv_direction = Vec3((cube1.position.x > cube2.position.x) ? 1.0f : -1.0f, 0.0f, 0.0f);
-                } else if (overlap_y < overlap_x && overlap_y < overlap_z) {
-                    mtv_magnitude = overlap_y;
-                    mtv_direction = Vec3(0.0f, (cube1.position.y > cube2.position.y) ? 1.0f : -1.0f, 0.0f);
-                } else {
-                    mtv_magnitude = overlap_z;
-                    mtv_direction = Vec3(0.0f, 0.0f, (cube1.position.z > cube2.position.z) ? 1.0f : -1.0f);
-                }
+    if constexpr (Policy::contactEvents) {
+        contactStream.publish<Policy>(world, stepSerial);
+    }
+}
 
-                float separation_amount = mtv_magnitude / 2.0f + 0.001f;
-                cube1.position = cube1.position + mtv_direction * separation_amount;
-                cube2.position = cube2.position - mtv_direction * separation_amount;
+template <typename Policy>
+void stepSimulation(float deltaTime) {
+    secondTimer += deltaTime;
+    if (secondTimer >= 1.0f) {
+        secondsCount++;
+        if constexpr (Policy::instrument) {
+            std::cout << "Seconds: " << secondsCount
+                      << " (last step: " << stepStats.pairTests << " pair tests, "
+                      << stepStats.contacts << " contacts, "
+                      << stepStats.wallHits << " wall hits, "
+                      << stepStats.deferred << " bodies deferred)" << std::endl;
+            if constexpr (FIXED_POINT_MODE) {
+                std::cout << "Lockstep tick " << lockstepWorld.tick << " state hash " << std::hex
+                          << lockstepWorld.stateHash() << std::dec << std::endl;
+            }
+        }
+        secondTimer = 0.0f;
+    }
 
-                float relative_velocity_along_mtv = (cube1.velocity - cube2.velocity).dot(mtv_direction);
+    // The lockstep world resets on its own tick count, which every replica
+    // agrees on; the frame timer does not.
+    resetTimer += deltaTime;
+    if (resetTimer >= RESET_INTERVAL_SECONDS && !FIXED_POINT_MODE) {
+        if constexpr (Policy::instrument) {
+            std::cout << "Resetting cubes due to timer." << std::endl;
+        }
+        resetCubes();
+    }
 
-                if (relative_velocity_along_mtv < 0) {
-                    float impulse = -(1.0f + BOUNCE_FACTOR) * relative_velocity_along_mtv / 2.0f;
-                    Vec3 impulse_vector = mtv_direction * impulse;
+    rotateY += AUTO_ROTATE_SPEED_Y * deltaTime;
+    rotateY = fmod(rotateY, 360.0f); 
 
-                    cube1.velocity = cube1.velocity + impulse_vector;
-                    cube2.velocity = cube2.velocity - impulse_vector;
+    if constexpr (Policy::instrument) {
+        stepStats = {0, 0, 0, 0};
+    }
 
-                    Vec3 tangential_velocity1 = cube1.velocity - mtv_direction * cube1.velocity.dot(mtv_direction);
-                    Vec3 tangential_velocity2 = cube2.velocity - mtv_direction * cube2.velocity.dot(mtv_direction);
-                    cube1.velocity = mtv_direction * cube1.velocity.dot(mtv_direction) + tangential_velocity1 * FRICTION_FACTOR;
-                    cube2.velocity = mtv_direction * cube2.velocity.dot(mtv_direction) + tangential_velocity2 * FRICTION_FACTOR;
+    simulationTime += deltaTime;
+    stepSerial++;
+    if constexpr (FIXED_POINT_MODE) {
+        lockstepWorld.advance(deltaTime);
+    } else {
+        stepWorld<Policy>(world, deltaTime);
+    }
+}
 
-                    cube1.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
-                    cube2.angularVelocity = Vec3(dist_angular_vel(rng), dist_angular_vel(rng), dist_angular_vel(rng));
-                }
-            }
-        }
+void updatePhysics(float deltaTime) {
+    if constexpr (UNBOUNDED_WORLD) {
+        stepSimulation<UnboundedStepPolicy>(deltaTime);
+    } else {
+        stepSimulation<DefaultStepPolicy>(deltaTime);
     }
 }
 
-void drawCube(const Vec3& position, const Vec3& rotation, float size) {
+void drawCube(const Matrix4& transform) {
     glPushMatrix();
 
-    glTranslatef(position.x, position.y, position.z);
-
-    glRotatef(rotation.x, 1.0f, 0.0f, 0.0f);
-    glRotatef(rotation.y, 0.0f, 1.0f, 0.0f);
-    glRotatef(rotation.z, 0.0f, 0.0f, 1.0f);
-
-    glScalef(size / 2.0f, size / 2.0f, size / 2.0f);
+    glMultMatrixf(transform.m);
 
     glColor3f(1.0f, 0.0f, 0.0f); 
     glBegin(GL_QUADS);
@@ -652,6 +6038,34 @@ void drawCube(const Vec3& position, const Vec3& rotation, float size) {
     glPopMatrix();
 }
 
+// The transform scales by half the size, so shapes are drawn at unit
+// half-extent: a sphere of radius 1, or a capsule of radius 0.5 whose
+// segment runs from y = -0.5 to 0.5.
+void drawShape(unsigned char shape, const Matrix4& transform) {
+    if (shape == SHAPE_BOX) {
+        drawCube(transform);
+        return;
+    }
+
+    glPushMatrix();
+    glMultMatrixf(transform.m);
+    if (shape == SHAPE_SPHERE) {
+        glColor3f(1.0f, 0.5f, 0.0f);
+        gluSphere(quadric, 1.0, 16, 12);
+    } else {
+        glColor3f(0.5f, 0.5f, 1.0f);
+        glPushMatrix();
+        glTranslatef(0.0f, -0.5f, 0.0f);
+        gluSphere(quadric, 0.5, 12, 8);
+        glRotatef(-90.0f, 1.0f, 0.0f, 0.0f);
+        gluCylinder(quadric, 0.5, 0.5, 1.0, 12, 1);
+        glPopMatrix();
+        glTranslatef(0.0f, 0.5f, 0.0f);
+        gluSphere(quadric, 0.5, 12, 8);
+    }
+    glPopMatrix();
+}
+
 void display() {
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -665,9 +6079,21 @@ void display() {
     glRotatef(rotateX, 1.0f, 0.0f, 0.0f);
     glRotatef(rotateY, 0.0f, 1.0f, 0.0f);
 
-    for (const auto& cube : cubes) {
-        drawCube(cube.position, cube.rotation, cube.size);
+    if constexpr (FIXED_POINT_MODE) {
+        drawLockstep();
+    } else {
+        simd.buildTransforms(world.pointers(), world.count(), simulationTime, world.transform.data());
+        for (const CompoundBody& compound : compounds) {
+            for (size_t k = 0; k < compound.transforms.size(); ++k) {
+                drawShape(compound.members[k].shape, compound.transforms[k]);
+            }
+        }
+        for (int i = 0; i < world.count(); ++i) {
+            drawShape(world.shape[i], world.transform[i]);
+        }
     }
+    drawGranular();
+    drawFluid();
 }
 
 void reshape(int width, int height) {